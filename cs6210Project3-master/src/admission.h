@@ -0,0 +1,137 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#include <grpcpp/grpcpp.h>
+#include "completion_tag.h"
+#include "threadpool.h"
+
+
+// Decides whether the store takes on a new request or turns it away at once
+// with RESOURCE_EXHAUSTED. A request is refused when the pool already holds
+// max_queued tasks, or when the tasks of its lane have lately been waiting
+// longer than max_wait to start. An empty lane has no wait, whatever its last
+// task waited. Interactive requests share the main lane
+// with continuations; bulk requests have a lane of their own that only runs
+// when the main one is empty, so bulk traffic is shed first.
+class Admission
+{
+public:
+	typedef std::chrono::steady_clock clock;
+
+	// A zero max_wait or max_queued leaves that check off
+	Admission(threadpool* pool, std::chrono::milliseconds max_wait, long max_queued);
+	bool Admit(Priority priority);
+	// Workers report how long each task in the lane waited to start
+	void Started(bool bulk, clock::duration waited);
+	uint64_t rejected() const;
+
+private:
+	struct Lane {
+		// How long the last task to start waited
+		std::atomic<int64_t> last_wait_us;
+		// When a task last started; 0 while the lane is idle
+		std::atomic<int64_t> last_start_us;
+		Lane() : last_wait_us(0), last_start_us(0) {}
+	};
+
+	static int64_t NowUs();
+	long Depth(bool bulk) const;
+	// Forgets the lane's last wait once it has nothing queued
+	void Idle(Lane& lane);
+
+	threadpool* pool_;
+	const int64_t max_wait_us_;
+	const long max_queued_;
+	Lane lanes_[2];
+	std::atomic<uint64_t> rejected_;
+};
+
+// The priority a client asked for with "x-priority: interactive|bulk"
+// metadata, or "fallback" if it did not.
+inline Priority RequestPriority(const grpc::ServerContext& ctx, Priority fallback) {
+	auto found = ctx.client_metadata().find("x-priority");
+	if (found == ctx.client_metadata().end()) {
+		return fallback;
+	}
+	std::string value(found->second.data(), found->second.size());
+	if (value == "bulk") {
+		return PRIORITY_BULK;
+	} else if (value == "interactive") {
+		return PRIORITY_INTERACTIVE;
+	}
+	return fallback;
+}
+
+inline Admission::Admission(threadpool* pool, std::chrono::milliseconds max_wait, long max_queued)
+	: pool_(pool), max_wait_us_(std::chrono::duration_cast<std::chrono::microseconds>(max_wait).count()),
+	  max_queued_(max_queued), rejected_(0) {}
+
+inline int64_t Admission::NowUs() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(clock::now().time_since_epoch()).count();
+}
+
+inline bool Admission::Admit(Priority priority) {
+	if (priority == PRIORITY_CONTINUATION) {
+		return true;
+	}
+	bool admit = true;
+	if (max_queued_ > 0 && pool_->queue_depth() >= max_queued_) {
+		admit = false;
+	} else if (max_wait_us_ > 0) {
+		bool bulk = priority == PRIORITY_BULK;
+		Lane& lane = lanes_[bulk];
+		if (Depth(bulk) <= 0) {
+			Idle(lane);
+		} else {
+			// With a queue, a new task waits about as long as the last one to
+			// start did, or longer if nothing in the lane has started lately.
+			// A lane that was idle starts that clock when it is first seen busy.
+			int64_t now = NowUs();
+			int64_t last_start = lane.last_start_us.load(std::memory_order_relaxed);
+			if (last_start == 0 && lane.last_start_us.compare_exchange_strong(last_start, now,
+																			  std::memory_order_relaxed)) {
+				last_start = now;
+			}
+			int64_t expected = std::max(lane.last_wait_us.load(std::memory_order_relaxed), now - last_start);
+			admit = expected <= max_wait_us_;
+		}
+	}
+	if (!admit) {
+		rejected_.fetch_add(1, std::memory_order_relaxed);
+	}
+	return admit;
+}
+
+inline void Admission::Started(bool bulk, clock::duration waited) {
+	Lane& lane = lanes_[bulk];
+	if (Depth(bulk) <= 0) {
+		// The last task of a burst: whatever comes next starts at once
+		Idle(lane);
+		return;
+	}
+	lane.last_wait_us.store(std::chrono::duration_cast<std::chrono::microseconds>(waited).count(),
+							std::memory_order_relaxed);
+	lane.last_start_us.store(NowUs(), std::memory_order_relaxed);
+}
+
+inline long Admission::Depth(bool bulk) const {
+	return bulk ? pool_->bulk_queue_depth() : pool_->queue_depth() - pool_->bulk_queue_depth();
+}
+
+inline void Admission::Idle(Lane& lane) {
+	// Checked first so that a steady stream of requests to an idle lane does
+	// not keep writing its cache line
+	if (lane.last_start_us.load(std::memory_order_relaxed) != 0) {
+		lane.last_wait_us.store(0, std::memory_order_relaxed);
+		lane.last_start_us.store(0, std::memory_order_relaxed);
+	}
+}
+
+inline uint64_t Admission::rejected() const {
+	return rejected_.load(std::memory_order_relaxed);
+}
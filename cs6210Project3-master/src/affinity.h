@@ -0,0 +1,18 @@
+#pragma once
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <thread>
+
+
+// Pins the calling thread to one core, wrapping around the cores this
+// machine has. Returns false if the kernel refused.
+inline bool PinCurrentThread(unsigned cpu) {
+	unsigned num_cpus = std::max(1u, std::thread::hardware_concurrency());
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu % num_cpus, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <algorithm>
+
+#include "store.grpc.pb.h"
+
+
+// What a ProductQuery asks the store to do with the bids it collects:
+// leave out bids above max_price, keep only the top_k cheapest, and reply
+// as soon as min_responses vendors have answered with a bid within max_price.
+// A zero field means no limit.
+
+inline bool WithinPrice(const store::ProductQuery& query, double price) {
+	return query.max_price() <= 0 || price <= query.max_price();
+}
+
+// Bids in "reply" that count towards min_responses
+inline size_t CountWithinPrice(const store::ProductQuery& query, const store::ProductReply& reply) {
+	size_t count = 0;
+	for (int i = 0; i < reply.products_size(); ++i) {
+		if (WithinPrice(query, reply.products(i).price())) {
+			++count;
+		}
+	}
+	return count;
+}
+
+// Drops the bids above max_price. With top_k set, it then keeps the top_k
+// cheapest, cheapest first. Only those are sorted. Without top_k the bids stay
+// in the order they arrived.
+inline void Aggregate(const store::ProductQuery& query, store::ProductReply* reply) {
+	google::protobuf::RepeatedPtrField<store::ProductInfo>* products = reply->mutable_products();
+	if (query.max_price() > 0) {
+		auto kept = std::stable_partition(products->pointer_begin(), products->pointer_end(),
+										  [&query](const store::ProductInfo* product) {
+											  return WithinPrice(query, product->price());
+										  });
+		int size = int(kept - products->pointer_begin());
+		products->DeleteSubrange(size, products->size() - size);
+	}
+	if (query.top_k() == 0) {
+		return;
+	}
+	auto cheaper = [](const store::ProductInfo* a, const store::ProductInfo* b) {
+		return a->price() < b->price();
+	};
+	int k = int(std::min<uint32_t>(query.top_k(), uint32_t(products->size())));
+	std::partial_sort(products->pointer_begin(), products->pointer_begin() + k, products->pointer_end(), cheaper);
+	products->DeleteSubrange(k, products->size() - k);
+}
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+#include "store.grpc.pb.h"
+#include "aggregation.h"
+#include "completion_tag.h"
+#include "vendor_dictionary.h"
+
+
+// The child stores a root store spreads its queries over. Each child serves
+// a shard of the vendors (or is a root over stores of its own) and answers
+// with a partial reply that the root merges.
+class ChildStores
+{
+public:
+	explicit ChildStores(const std::vector<std::string>& addresses);
+	size_t size() const;
+	const std::string& address(size_t i) const;
+	store::Store::Stub* stub(size_t i);
+	// Warms up every channel, waiting at most "timeout" in total. Returns how
+	// many children are ready.
+	size_t Connect(std::chrono::milliseconds timeout);
+
+private:
+	std::vector<std::string> addresses_;
+	std::vector<std::shared_ptr<grpc::Channel> > channels_;
+	std::vector<std::unique_ptr<store::Store::Stub> > stubs_;
+};
+
+// How a root store forwards one kind of query and merges the answers. The
+// traits below cover getProducts and getProductsBatch.
+struct ProductsTraits
+{
+	typedef store::ProductQuery Request;
+	typedef store::ProductReply Reply;
+	static const Priority priority = PRIORITY_INTERACTIVE;
+
+	static void RequestCall(store::Store::AsyncService* service, grpc::ServerContext* ctx, Request* request,
+							grpc::ServerAsyncResponseWriter<Reply>* responder, grpc::ServerCompletionQueue* cq,
+							void* tag) {
+		service->RequestgetProducts(ctx, request, responder, cq, cq, tag);
+	}
+
+	static std::unique_ptr<grpc::ClientAsyncResponseReader<Reply> > Call(store::Store::Stub* stub,
+																		   grpc::ClientContext* context,
+																		   const Request& request,
+																		   grpc::CompletionQueue* cq) {
+		return stub->PrepareAsyncgetProducts(context, request, cq);
+	}
+
+	static void Prepare(const Request&, Reply*) {}
+
+	// The query as sent on to the children. Their replies are merged in full,
+	// so only the root compacts.
+	static void Forward(const Request& request, Request* forwarded) {
+		forwarded->CopyFrom(request);
+		forwarded->clear_compact();
+		forwarded->clear_dictionary_epoch();
+		forwarded->clear_dictionary_size();
+	}
+
+	static void Merge(const Reply& from, Reply* into) {
+		into->mutable_products()->MergeFrom(from.products());
+		into->mutable_missing_vendors()->MergeFrom(from.missing_vendors());
+	}
+
+	// A child that fails is named in place of the vendors it serves
+	static void Missing(const std::string& child, Reply* into) {
+		into->add_missing_vendors(child);
+	}
+
+	static bool Quorate(const Request& request, const Reply& reply) {
+		return request.min_responses() > 0 && CountWithinPrice(request, reply) >= request.min_responses();
+	}
+
+	// Each child has already cut its own reply down; the merged one is cut
+	// down again so that, say, top_k holds across all of them
+	static void Finish(const Request& request, VendorDictionary* dictionary, Reply* reply) {
+		Aggregate(request, reply);
+		if (request.compact()) {
+			dictionary->Compact(request, reply);
+		}
+	}
+};
+
+struct BatchTraits
+{
+	typedef store::ProductBatchQuery Request;
+	typedef store::ProductBatchReply Reply;
+	static const Priority priority = PRIORITY_BULK;
+
+	static void RequestCall(store::Store::AsyncService* service, grpc::ServerContext* ctx, Request* request,
+							grpc::ServerAsyncResponseWriter<Reply>* responder, grpc::ServerCompletionQueue* cq,
+							void* tag) {
+		service->RequestgetProductsBatch(ctx, request, responder, cq, cq, tag);
+	}
+
+	static std::unique_ptr<grpc::ClientAsyncResponseReader<Reply> > Call(store::Store::Stub* stub,
+																		   grpc::ClientContext* context,
+																		   const Request& request,
+																		   grpc::CompletionQueue* cq) {
+		return stub->PrepareAsyncgetProductsBatch(context, request, cq);
+	}
+
+	static void Prepare(const Request& request, Reply* reply) {
+		for (int i = 0; i < request.product_names_size(); ++i) {
+			reply->add_replies();
+		}
+	}
+
+	static void Forward(const Request& request, Request* forwarded) {
+		forwarded->CopyFrom(request);
+	}
+
+	static void Merge(const Reply& from, Reply* into) {
+		for (int i = 0; i < from.replies_size() && i < into->replies_size(); ++i) {
+			ProductsTraits::Merge(from.replies(i), into->mutable_replies(i));
+		}
+	}
+
+	static void Missing(const std::string& child, Reply* into) {
+		for (int i = 0; i < into->replies_size(); ++i) {
+			into->mutable_replies(i)->add_missing_vendors(child);
+		}
+	}
+
+	static bool Quorate(const Request&, const Reply&) {
+		return false;
+	}
+
+	static void Finish(const Request&, VendorDictionary*, Reply*) {}
+};
+
+inline ChildStores::ChildStores(const std::vector<std::string>& addresses) : addresses_(addresses) {
+	for (size_t i = 0; i < addresses_.size(); ++i) {
+		channels_.push_back(grpc::CreateChannel(addresses_[i], grpc::InsecureChannelCredentials()));
+		stubs_.emplace_back(store::Store::NewStub(channels_.back()));
+	}
+}
+
+inline size_t ChildStores::size() const {
+	return addresses_.size();
+}
+
+inline const std::string& ChildStores::address(size_t i) const {
+	return addresses_[i];
+}
+
+inline store::Store::Stub* ChildStores::stub(size_t i) {
+	return stubs_[i].get();
+}
+
+inline size_t ChildStores::Connect(std::chrono::milliseconds timeout) {
+	std::chrono::system_clock::time_point deadline = std::chrono::system_clock::now() + timeout;
+	for (size_t i = 0; i < channels_.size(); ++i) {
+		channels_[i]->GetState(true);
+	}
+	size_t ready = 0;
+	for (size_t i = 0; i < channels_.size(); ++i) {
+		if (channels_[i]->WaitForConnected(deadline)) {
+			++ready;
+		}
+	}
+	return ready;
+}
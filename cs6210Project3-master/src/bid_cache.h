@@ -0,0 +1,278 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "store.grpc.pb.h"
+#include "vendor_registry.h"
+
+
+// Someone waiting on another request's vendor fan-out for the same product.
+class BidWaiter
+{
+public:
+	virtual ~BidWaiter() {}
+	// Called once with the bids the fan-out collected.
+	virtual void OnBids(const store::ProductReply& reply) = 0;
+};
+
+// Recently seen bids, keyed by product and then by vendor address. Each bid
+// expires on its own after the TTL, so a query only has to ask the vendors
+// whose bids went stale. The cache is split into shards, each with its own
+// lock, LRU list and share of the memory budget.
+//
+// It also coalesces misses: while one request is fetching a product, other
+// requests for it join as waiters instead of starting their own fan-out.
+class BidCache
+{
+public:
+	typedef std::chrono::steady_clock clock;
+
+	BidCache(std::chrono::milliseconds ttl, size_t budget_bytes, size_t num_shards);
+
+	// Adds the fresh bids for "product" to "reply" and the indices of the
+	// vendors that still have to be asked to "stale". Ejected vendors without
+	// a fresh bid are not asked; they go in the reply as missing. Returns true
+	// when nothing is stale.
+	bool Lookup(const std::string& product, VendorRegistry& vendors,
+				store::ProductReply* reply, std::vector<size_t>* stale);
+	// Returns true if the caller should fetch "product" itself. Otherwise a
+	// fetch is already in flight and "waiter" gets its result.
+	bool Join(const std::string& product, BidWaiter* waiter);
+	// Takes back a Join() that lost, for a waiter that can wait no longer.
+	// Returns false if the fetch has already completed, in which case the
+	// waiter is being handed its result.
+	bool Leave(const std::string& product, BidWaiter* waiter);
+	// Called by the request that won Join() once its fan-out is done. Stores
+	// the bids it fetched, given as (vendor address, bid) pairs, and hands
+	// "reply" to everyone who joined.
+	void Complete(const std::string& product,
+				  const std::vector<std::pair<std::string, store::ProductInfo> >& fetched,
+				  const store::ProductReply& reply);
+	// Stores bids fetched outside of Join(), leaving any fetch in flight alone.
+	void Insert(const std::string& product,
+				const std::vector<std::pair<std::string, store::ProductInfo> >& fetched);
+
+	// Cache counters, summed over the shards
+	size_t hits();
+	size_t misses();
+	size_t coalesced();
+
+private:
+	struct Bid {
+		store::ProductInfo info;
+		clock::time_point fetched_at;
+	};
+
+	struct Entry {
+		std::string product;
+		// Keyed by vendor address
+		std::unordered_map<std::string, Bid> bids;
+		size_t bytes;
+	};
+
+	struct Shard {
+		std::mutex mutex;
+		// Most recently used at the front
+		std::list<Entry> lru;
+		std::unordered_map<std::string, std::list<Entry>::iterator> index;
+		std::unordered_map<std::string, std::vector<BidWaiter*> > in_flight;
+		size_t bytes = 0;
+		size_t hits = 0;
+		size_t misses = 0;
+		size_t coalesced = 0;
+	};
+
+	Shard& ShardFor(const std::string& product);
+	// Called with the shard's lock held
+	void Store(Shard& shard, const std::string& product,
+			   const std::vector<std::pair<std::string, store::ProductInfo> >& fetched);
+	static size_t BidBytes(const std::string& address, const store::ProductInfo& info);
+
+	const clock::duration ttl_;
+	const size_t shard_budget_;
+	std::vector<std::unique_ptr<Shard> > shards_;
+	std::hash<std::string> hasher_;
+};
+
+inline BidCache::BidCache(std::chrono::milliseconds ttl, size_t budget_bytes, size_t num_shards)
+	: ttl_(ttl), shard_budget_(budget_bytes / std::max<size_t>(1, num_shards)) {
+	for (size_t i = 0; i < std::max<size_t>(1, num_shards); ++i) {
+		shards_.emplace_back(new Shard());
+	}
+}
+
+inline BidCache::Shard& BidCache::ShardFor(const std::string& product) {
+	return *shards_[hasher_(product) % shards_.size()];
+}
+
+// Rough heap footprint of one cached bid
+inline size_t BidCache::BidBytes(const std::string& address, const store::ProductInfo& info) {
+	return sizeof(Bid) + address.size() + info.vendor_id().size() + 64;
+}
+
+inline bool BidCache::Lookup(const std::string& product, VendorRegistry& vendors,
+							 store::ProductReply* reply, std::vector<size_t>* stale) {
+	Shard& shard = ShardFor(product);
+	clock::time_point now = clock::now();
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	auto found = shard.index.find(product);
+	if (found == shard.index.end()) {
+		for (size_t i = 0; i < vendors.size(); ++i) {
+			if (vendors[i].health().state() == VendorHealth::EJECTED) {
+				reply->add_missing_vendors(vendors[i].address());
+			} else {
+				stale->push_back(i);
+			}
+		}
+		++shard.misses;
+		return stale->empty();
+	}
+
+	// Touch the entry so it is the last to be evicted
+	shard.lru.splice(shard.lru.begin(), shard.lru, found->second);
+	const Entry& entry = *found->second;
+	for (size_t i = 0; i < vendors.size(); ++i) {
+		auto bid = entry.bids.find(vendors[i].address());
+		if (bid != entry.bids.end() && now - bid->second.fetched_at < ttl_) {
+			*reply->add_products() = bid->second.info;
+		} else if (vendors[i].health().state() == VendorHealth::EJECTED) {
+			reply->add_missing_vendors(vendors[i].address());
+		} else {
+			stale->push_back(i);
+		}
+	}
+	if (stale->empty()) {
+		++shard.hits;
+	} else {
+		++shard.misses;
+	}
+	return stale->empty();
+}
+
+inline bool BidCache::Join(const std::string& product, BidWaiter* waiter) {
+	Shard& shard = ShardFor(product);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	auto flight = shard.in_flight.find(product);
+	if (flight == shard.in_flight.end()) {
+		shard.in_flight[product];
+		return true;
+	}
+	flight->second.push_back(waiter);
+	++shard.coalesced;
+	return false;
+}
+
+inline bool BidCache::Leave(const std::string& product, BidWaiter* waiter) {
+	Shard& shard = ShardFor(product);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	auto flight = shard.in_flight.find(product);
+	if (flight == shard.in_flight.end()) {
+		return false;
+	}
+	std::vector<BidWaiter*>& waiters = flight->second;
+	auto found = std::find(waiters.begin(), waiters.end(), waiter);
+	if (found == waiters.end()) {
+		return false;
+	}
+	waiters.erase(found);
+	return true;
+}
+
+inline void BidCache::Complete(const std::string& product,
+							   const std::vector<std::pair<std::string, store::ProductInfo> >& fetched,
+							   const store::ProductReply& reply) {
+	Shard& shard = ShardFor(product);
+	std::vector<BidWaiter*> waiters;
+	{
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		auto flight = shard.in_flight.find(product);
+		if (flight != shard.in_flight.end()) {
+			waiters.swap(flight->second);
+			shard.in_flight.erase(flight);
+		}
+		Store(shard, product, fetched);
+	}
+
+	// Outside the lock: the waiters send their replies from here
+	for (size_t i = 0; i < waiters.size(); ++i) {
+		waiters[i]->OnBids(reply);
+	}
+}
+
+inline void BidCache::Insert(const std::string& product,
+							 const std::vector<std::pair<std::string, store::ProductInfo> >& fetched) {
+	Shard& shard = ShardFor(product);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	Store(shard, product, fetched);
+}
+
+inline void BidCache::Store(Shard& shard, const std::string& product,
+							const std::vector<std::pair<std::string, store::ProductInfo> >& fetched) {
+	clock::time_point now = clock::now();
+	auto found = shard.index.find(product);
+	if (found == shard.index.end()) {
+		shard.lru.push_front(Entry());
+		shard.lru.front().product = product;
+		shard.lru.front().bytes = sizeof(Entry) + 2 * product.size() + 64;
+		shard.bytes += shard.lru.front().bytes;
+		found = shard.index.insert(std::make_pair(product, shard.lru.begin())).first;
+	} else {
+		shard.lru.splice(shard.lru.begin(), shard.lru, found->second);
+	}
+	Entry& entry = *found->second;
+	for (size_t i = 0; i < fetched.size(); ++i) {
+		Bid& bid = entry.bids[fetched[i].first];
+		size_t old_bytes = bid.fetched_at == clock::time_point() ? 0 : BidBytes(fetched[i].first, bid.info);
+		bid.info = fetched[i].second;
+		bid.fetched_at = now;
+		size_t new_bytes = BidBytes(fetched[i].first, bid.info);
+		entry.bytes += new_bytes - old_bytes;
+		shard.bytes += new_bytes - old_bytes;
+	}
+
+	// Evict from the cold end until we are back under budget, but never the
+	// entry we just filled
+	while (shard.bytes > shard_budget_ && shard.lru.size() > 1) {
+		Entry& victim = shard.lru.back();
+		shard.bytes -= victim.bytes;
+		shard.index.erase(victim.product);
+		shard.lru.pop_back();
+	}
+}
+
+inline size_t BidCache::hits() {
+	size_t total = 0;
+	for (size_t i = 0; i < shards_.size(); ++i) {
+		std::lock_guard<std::mutex> lock(shards_[i]->mutex);
+		total += shards_[i]->hits;
+	}
+	return total;
+}
+
+inline size_t BidCache::misses() {
+	size_t total = 0;
+	for (size_t i = 0; i < shards_.size(); ++i) {
+		std::lock_guard<std::mutex> lock(shards_[i]->mutex);
+		total += shards_[i]->misses;
+	}
+	return total;
+}
+
+inline size_t BidCache::coalesced() {
+	size_t total = 0;
+	for (size_t i = 0; i < shards_.size(); ++i) {
+		std::lock_guard<std::mutex> lock(shards_[i]->mutex);
+		total += shards_[i]->coalesced;
+	}
+	return total;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+
+// How urgently an event should be handled. Anything that carries on a request
+// the store has already taken on is a continuation and is never turned away;
+// new requests are interactive or bulk.
+enum Priority
+{
+	PRIORITY_CONTINUATION,
+	PRIORITY_INTERACTIVE,
+	PRIORITY_BULK
+};
+
+// Anything whose address is handed to a completion queue as a tag. The event
+// loop does not need to know what kind of operation finished; it just lets
+// the tag carry on from where it left off.
+class CompletionTag
+{
+public:
+	virtual ~CompletionTag() {}
+	// Called once the event for this tag has been dequeued. "ok" is the flag
+	// Next() returned with it.
+	virtual void Proceed(bool ok) = 0;
+	// Asked by the event loop before Proceed. Only a tag whose event is a new
+	// request returns anything but a continuation.
+	virtual Priority priority() const { return PRIORITY_CONTINUATION; }
+	// Called instead of Proceed when the store is too busy to take on the new
+	// request. Tags that can report a request priority must implement it.
+	virtual void Reject() {}
+};
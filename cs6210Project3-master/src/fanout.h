@@ -0,0 +1,262 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <grpcpp/alarm.h>
+#include <grpcpp/grpcpp.h>
+#include "vendor.grpc.pb.h"
+#include "completion_tag.h"
+#include "vendor_registry.h"
+
+
+// Told how a Fanout is getting on. The vendor callbacks may run on several
+// workers at once.
+class FanoutListener
+{
+public:
+	virtual ~FanoutListener() {}
+	// A vendor answered. Called at most once per vendor.
+	virtual void OnBid(size_t vendor, const vendor::BidReply& bid) = 0;
+	// A vendor failed or missed the deadline. Called at most once per vendor.
+	virtual void OnMissing(size_t vendor, const grpc::Status& status) = 0;
+	// Every vendor asked has answered or been given up on.
+	virtual void OnFanoutDone() = 0;
+	// Every completion the fan-out put on the queue has come back, so it may
+	// now be destroyed. Always called after OnFanoutDone.
+	virtual void OnFanoutReleased() = 0;
+};
+
+// Asks a set of vendors for their bid on one product, all at once, on a
+// completion queue whose events are handed to CompletionTag::Proceed.
+//
+// Vendors the registry has ejected are not asked; they are reported missing
+// straight away. No vendor is waited on past the deadline. With hedging on, a vendor that
+// has not answered within its usual p95 is asked again on another
+// sub-channel, and whichever answer comes first is used; the other call is
+// cancelled.
+class Fanout
+{
+public:
+	typedef std::chrono::steady_clock clock;
+
+	Fanout(FanoutListener* listener, grpc::CompletionQueue* cq);
+	void Start(const std::string& product, VendorRegistry& vendors, const std::vector<size_t>& to_ask,
+			   std::chrono::system_clock::time_point deadline, bool hedge);
+	// Stops waiting on the vendors that have not answered yet: their calls
+	// are cancelled and they are reported missing with CANCELLED. Safe to call
+	// from a listener callback, even while Start is still issuing.
+	void Cancel();
+
+private:
+	struct Slot;
+
+	// One call to a vendor; a slot has one, or two once hedged
+	struct Attempt : public AsyncBidCall {
+		Slot* slot;
+		clock::time_point started;
+		int channel;
+		void Proceed(bool ok) override;
+	};
+
+	// Fires when a vendor is slow enough to be worth asking again
+	struct HedgeTimer : public CompletionTag {
+		Slot* slot;
+		grpc::Alarm alarm;
+		void Proceed(bool ok) override;
+	};
+
+	struct Slot {
+		Fanout* fanout;
+		size_t vendor;
+		VendorEndpoint* endpoint;
+		// Guards creating and cancelling the attempts and the timer
+		std::mutex mutex;
+		Attempt primary;
+		std::unique_ptr<Attempt> hedge;
+		std::unique_ptr<HedgeTimer> timer;
+		// Attempts still out
+		std::atomic<int> in_flight{0};
+		// Set by whichever completion reports the vendor to the listener.
+		// Cancel may read it before Start gets to the slot.
+		std::atomic<bool> resolved{false};
+	};
+
+	void Issue(Slot* slot, Attempt* attempt, int avoid);
+	void OnAttempt(Attempt* attempt, bool ok);
+	void OnTimer(Slot* slot, bool ok);
+	// Cancels whatever is still out for the slot, apart from "keep"
+	void CancelRest(Slot* slot, Attempt* keep);
+	void Resolve();
+	void Unref();
+
+	FanoutListener* listener_;
+	grpc::CompletionQueue* cq_;
+	VendorRegistry* vendors_;
+	// The BidQuery, encoded once for every vendor
+	grpc::ByteBuffer query_;
+	std::chrono::system_clock::time_point deadline_;
+	std::unique_ptr<Slot[]> slots_;
+	size_t num_slots_;
+	std::atomic<bool> cancelled_;
+	// Vendors not yet resolved, plus one while they are being issued
+	std::atomic<size_t> unresolved_;
+	// Completions still to come back, plus one while they are being issued
+	std::atomic<size_t> refs_;
+};
+
+inline Fanout::Fanout(FanoutListener* listener, grpc::CompletionQueue* cq)
+	: listener_(listener), cq_(cq), vendors_(nullptr), num_slots_(0), cancelled_(false), unresolved_(0), refs_(0) {}
+
+inline void Fanout::Start(const std::string& product, VendorRegistry& vendors, const std::vector<size_t>& to_ask,
+						  std::chrono::system_clock::time_point deadline, bool hedge) {
+	vendors_ = &vendors;
+	vendor::BidQuery query;
+	query.set_product_name(product);
+	query_ = SerializeQuery(query);
+	deadline_ = deadline;
+	slots_.reset(new Slot[to_ask.size()]);
+	num_slots_ = to_ask.size();
+	cancelled_ = false;
+	unresolved_ = to_ask.size() + 1;
+	refs_ = 1;
+	for (size_t i = 0; i < to_ask.size(); ++i) {
+		Slot* slot = &slots_[i];
+		slot->fanout = this;
+		slot->vendor = to_ask[i];
+		slot->endpoint = &vendors[to_ask[i]];
+		slot->in_flight = 1;
+		slot->resolved = false;
+		slot->primary.slot = slot;
+		if (!vendors.Allow(to_ask[i])) {
+			slot->resolved = true;
+			listener_->OnMissing(slot->vendor, EjectedStatus());
+			Resolve();
+			continue;
+		}
+
+		std::chrono::microseconds p95 = slot->endpoint->latency().p95();
+		// The timer is made and set under the slot lock, so that neither an
+		// early answer nor a Cancel on another thread can reach it before it
+		// exists
+		std::unique_lock<std::mutex> lock(slot->mutex);
+		if (hedge && p95.count() > 0 && std::chrono::system_clock::now() + p95 < deadline_) {
+			slot->timer.reset(new HedgeTimer());
+			slot->timer->slot = slot;
+		}
+		if (cancelled_) {
+			lock.unlock();
+			slot->resolved = true;
+			listener_->OnMissing(slot->vendor, grpc::Status::CANCELLED);
+			Resolve();
+			continue;
+		}
+		refs_ += slot->timer ? 2 : 1;
+		Issue(slot, &slot->primary, -1);
+		if (slot->timer) {
+			slot->timer->alarm.Set(cq_, std::chrono::system_clock::now() + p95,
+								   static_cast<CompletionTag*>(slot->timer.get()));
+		}
+	}
+	Resolve();
+	Unref();
+}
+
+inline void Fanout::Issue(Slot* slot, Attempt* attempt, int avoid) {
+	attempt->slot = slot;
+	attempt->started = clock::now();
+	if (deadline_ != std::chrono::system_clock::time_point::max()) {
+		attempt->context.set_deadline(deadline_);
+	}
+	attempt->channel = slot->endpoint->AsyncAskBid(query_, cq_, attempt, avoid);
+}
+
+inline void Fanout::Attempt::Proceed(bool ok) {
+	slot->fanout->OnAttempt(this, ok);
+}
+
+inline void Fanout::HedgeTimer::Proceed(bool ok) {
+	slot->fanout->OnTimer(slot, ok);
+}
+
+inline void Fanout::OnAttempt(Attempt* attempt, bool ok) {
+	Slot* slot = attempt->slot;
+	int left = slot->in_flight.fetch_sub(1) - 1;
+	if (ok && attempt->status.ok()) {
+		if (!slot->resolved.exchange(true)) {
+			vendors_->Succeeded(slot->vendor,
+								std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - attempt->started));
+			listener_->OnBid(slot->vendor, attempt->reply);
+			CancelRest(slot, attempt);
+			Resolve();
+		} else {
+			// A hedge that lost the race still shows the vendor is up
+			vendors_->Succeeded(slot->vendor);
+		}
+		Unref();
+		return;
+	}
+	// Calls we cancelled ourselves say nothing about the vendor
+	if (attempt->status.error_code() != grpc::StatusCode::CANCELLED) {
+		vendors_->Failed(slot->vendor);
+	}
+	if (left == 0 && !slot->resolved.exchange(true)) {
+		// Only give up on the vendor once its last attempt has failed
+		listener_->OnMissing(slot->vendor, attempt->status);
+		CancelRest(slot, attempt);
+		Resolve();
+	}
+	Unref();
+}
+
+inline void Fanout::OnTimer(Slot* slot, bool ok) {
+	// Not ok means the timer was cancelled because the vendor already answered
+	if (ok && !slot->resolved) {
+		std::lock_guard<std::mutex> lock(slot->mutex);
+		if (!slot->resolved && !cancelled_) {
+			slot->hedge.reset(new Attempt());
+			++slot->in_flight;
+			++refs_;
+			Issue(slot, slot->hedge.get(), slot->primary.channel);
+		}
+	}
+	Unref();
+}
+
+inline void Fanout::Cancel() {
+	cancelled_ = true;
+	for (size_t i = 0; i < num_slots_; ++i) {
+		if (!slots_[i].resolved) {
+			CancelRest(&slots_[i], nullptr);
+		}
+	}
+}
+
+inline void Fanout::CancelRest(Slot* slot, Attempt* keep) {
+	std::lock_guard<std::mutex> lock(slot->mutex);
+	if (keep != &slot->primary) {
+		slot->primary.context.TryCancel();
+	}
+	if (slot->hedge && keep != slot->hedge.get()) {
+		slot->hedge->context.TryCancel();
+	}
+	if (slot->timer) {
+		slot->timer->alarm.Cancel();
+	}
+}
+
+inline void Fanout::Resolve() {
+	if (unresolved_.fetch_sub(1) == 1) {
+		listener_->OnFanoutDone();
+	}
+}
+
+inline void Fanout::Unref() {
+	if (refs_.fetch_sub(1) == 1) {
+		listener_->OnFanoutReleased();
+	}
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <vector>
+
+
+// Recycles blocks of sizeof(T) bytes. Each thread keeps its own cache of free
+// blocks, so allocating and freeing normally touch no lock. A thread whose
+// cache runs dry takes a batch from a shared list, and one whose cache grows
+// too big gives a batch back. That way a block freed on one thread (a request
+// finished by another worker) can be reused on another.
+template<class T>
+class FreeList
+{
+public:
+	static const size_t batch = 32;
+
+	static void* Allocate();
+	static void Free(void* block);
+
+private:
+	struct Shared {
+		std::mutex mutex;
+		std::vector<void*> blocks;
+	};
+
+	// Hands the thread's blocks back to the shared list when the thread exits
+	struct Cache {
+		std::vector<void*> blocks;
+		Cache() { blocks.reserve(2 * batch); }
+		~Cache();
+	};
+
+	static Shared& shared();
+	static Cache& cache();
+};
+
+template<class T>
+const size_t FreeList<T>::batch;
+
+template<class T>
+typename FreeList<T>::Shared& FreeList<T>::shared() {
+	// Never destroyed, so blocks can still be freed during static destruction
+	static Shared* instance = new Shared();
+	return *instance;
+}
+
+template<class T>
+typename FreeList<T>::Cache& FreeList<T>::cache() {
+	static thread_local Cache instance;
+	return instance;
+}
+
+template<class T>
+FreeList<T>::Cache::~Cache() {
+	Shared& s = shared();
+	std::lock_guard<std::mutex> lock(s.mutex);
+	s.blocks.insert(s.blocks.end(), blocks.begin(), blocks.end());
+}
+
+template<class T>
+void* FreeList<T>::Allocate() {
+	Cache& local = cache();
+	if (local.blocks.empty()) {
+		Shared& s = shared();
+		std::lock_guard<std::mutex> lock(s.mutex);
+		size_t take = std::min<size_t>(batch, s.blocks.size());
+		local.blocks.insert(local.blocks.end(), s.blocks.end() - take, s.blocks.end());
+		s.blocks.resize(s.blocks.size() - take);
+	}
+	if (local.blocks.empty()) {
+		return ::operator new(sizeof(T));
+	}
+	void* block = local.blocks.back();
+	local.blocks.pop_back();
+	return block;
+}
+
+template<class T>
+void FreeList<T>::Free(void* block) {
+	Cache& local = cache();
+	local.blocks.push_back(block);
+	if (local.blocks.size() >= 2 * batch) {
+		Shared& s = shared();
+		std::lock_guard<std::mutex> lock(s.mutex);
+		s.blocks.insert(s.blocks.end(), local.blocks.end() - batch, local.blocks.end());
+		local.blocks.resize(local.blocks.size() - batch);
+	}
+}
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+
+// A latency histogram that any thread can record into without a lock. Buckets
+// are log-linear, as in HdrHistogram: below 2^SubBucketBits every value has
+// its own bucket, and above that each power of two is split into
+// 2^(SubBucketBits - 1) equal steps, so a value is never off by more than
+// one step, whatever its size. Values of 2^MaxBits and above land in the last
+// bucket.
+//
+// The store records into one per thread and merges them into a snapshot to
+// report; the test tools use the finer LatencyHistogram the same way.
+template<int SubBucketBits, int MaxBits>
+class BasicHistogram
+{
+public:
+	static const int sub_bucket_bits = SubBucketBits;
+	static const int max_bits = MaxBits;
+	static const size_t num_buckets = (size_t(1) << SubBucketBits) + (MaxBits - SubBucketBits) * (size_t(1) << (SubBucketBits - 1));
+
+	BasicHistogram();
+	// Copies are snapshots of "other"
+	BasicHistogram(const BasicHistogram& other);
+	BasicHistogram& operator=(const BasicHistogram& other);
+
+	void Record(uint64_t value);
+	// Adds the values recorded in "other" to ours
+	void Merge(const BasicHistogram& other);
+	void Clear();
+
+	uint64_t Count() const;
+	uint64_t Max() const;
+	double Mean() const;
+	// The smallest recorded value that "p" percent of the values are at or
+	// below, e.g. Percentile(99.9), to within a bucket
+	uint64_t Percentile(double p) const;
+
+private:
+	static size_t IndexOf(uint64_t value);
+	// The largest value that falls in bucket "index"
+	static uint64_t HighestIn(size_t index);
+
+	std::atomic<uint64_t> counts_[num_buckets];
+	std::atomic<uint64_t> sum_;
+	std::atomic<uint64_t> max_;
+};
+
+// What the store keeps per thread, per stage and per vendor: coarse, so that
+// there is room for a lot of them
+typedef BasicHistogram<4, 40> Histogram;
+// What the test tools report from: about 3% resolution, across the full range
+typedef BasicHistogram<6, 64> LatencyHistogram;
+
+template<int SubBucketBits, int MaxBits>
+inline BasicHistogram<SubBucketBits, MaxBits>::BasicHistogram() {
+	Clear();
+}
+
+template<int SubBucketBits, int MaxBits>
+inline BasicHistogram<SubBucketBits, MaxBits>::BasicHistogram(const BasicHistogram& other) {
+	Clear();
+	Merge(other);
+}
+
+template<int SubBucketBits, int MaxBits>
+inline BasicHistogram<SubBucketBits, MaxBits>& BasicHistogram<SubBucketBits, MaxBits>::operator=(
+	const BasicHistogram& other) {
+	if (this != &other) {
+		Clear();
+		Merge(other);
+	}
+	return *this;
+}
+
+template<int SubBucketBits, int MaxBits>
+inline size_t BasicHistogram<SubBucketBits, MaxBits>::IndexOf(uint64_t value) {
+	const uint64_t sub_buckets = uint64_t(1) << SubBucketBits;
+	const uint64_t half = sub_buckets / 2;
+	if (value < sub_buckets) {
+		return value;
+	}
+	int msb = 63 - __builtin_clzll(value);
+	int shift = msb - SubBucketBits + 1;
+	size_t index = sub_buckets + (shift - 1) * half + ((value >> shift) - half);
+	return std::min(index, num_buckets - 1);
+}
+
+template<int SubBucketBits, int MaxBits>
+inline uint64_t BasicHistogram<SubBucketBits, MaxBits>::HighestIn(size_t index) {
+	const uint64_t sub_buckets = uint64_t(1) << SubBucketBits;
+	const uint64_t half = sub_buckets / 2;
+	if (index < sub_buckets) {
+		return index;
+	}
+	uint64_t k = index - sub_buckets;
+	int shift = int(k / half) + 1;
+	uint64_t sub = k % half + half;
+	return ((sub + 1) << shift) - 1;
+}
+
+template<int SubBucketBits, int MaxBits>
+inline void BasicHistogram<SubBucketBits, MaxBits>::Record(uint64_t value) {
+	counts_[IndexOf(value)].fetch_add(1, std::memory_order_relaxed);
+	sum_.fetch_add(value, std::memory_order_relaxed);
+	uint64_t max = max_.load(std::memory_order_relaxed);
+	while (value > max && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+	}
+}
+
+template<int SubBucketBits, int MaxBits>
+inline void BasicHistogram<SubBucketBits, MaxBits>::Merge(const BasicHistogram& other) {
+	for (size_t i = 0; i < num_buckets; ++i) {
+		counts_[i].fetch_add(other.counts_[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+	}
+	sum_.fetch_add(other.sum_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	uint64_t value = other.max_.load(std::memory_order_relaxed);
+	uint64_t max = max_.load(std::memory_order_relaxed);
+	while (value > max && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+	}
+}
+
+template<int SubBucketBits, int MaxBits>
+inline void BasicHistogram<SubBucketBits, MaxBits>::Clear() {
+	for (size_t i = 0; i < num_buckets; ++i) {
+		counts_[i].store(0, std::memory_order_relaxed);
+	}
+	sum_.store(0, std::memory_order_relaxed);
+	max_.store(0, std::memory_order_relaxed);
+}
+
+template<int SubBucketBits, int MaxBits>
+inline uint64_t BasicHistogram<SubBucketBits, MaxBits>::Count() const {
+	uint64_t total = 0;
+	for (size_t i = 0; i < num_buckets; ++i) {
+		total += counts_[i].load(std::memory_order_relaxed);
+	}
+	return total;
+}
+
+template<int SubBucketBits, int MaxBits>
+inline uint64_t BasicHistogram<SubBucketBits, MaxBits>::Max() const {
+	return max_.load(std::memory_order_relaxed);
+}
+
+template<int SubBucketBits, int MaxBits>
+inline double BasicHistogram<SubBucketBits, MaxBits>::Mean() const {
+	uint64_t count = Count();
+	return count ? double(sum_.load(std::memory_order_relaxed)) / count : 0;
+}
+
+template<int SubBucketBits, int MaxBits>
+inline uint64_t BasicHistogram<SubBucketBits, MaxBits>::Percentile(double p) const {
+	uint64_t total = Count();
+	if (total == 0) {
+		return 0;
+	}
+	uint64_t target = std::max<uint64_t>(1, uint64_t(p / 100.0 * total + 0.999999));
+	uint64_t seen = 0;
+	for (size_t i = 0; i < num_buckets; ++i) {
+		seen += counts_[i].load(std::memory_order_relaxed);
+		if (seen >= target) {
+			return std::min(HighestIn(i), Max());
+		}
+	}
+	return Max();
+}
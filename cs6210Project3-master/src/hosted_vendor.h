@@ -0,0 +1,224 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+
+#include <grpcpp/grpcpp.h>
+#include <grpcpp/alarm.h>
+#include "vendor.grpc.pb.h"
+#include "completion_tag.h"
+
+
+// A vendor served by one of our own processes: run_vendors hosts the test
+// vendors this way, and the store hosts them itself with --inprocess_vendors.
+// Every hosted vendor prices bids alike, so the store gets the same answers
+// whichever hosts them. By default a vendor answers at once; run_vendors'
+// vendors override the hooks below to take time or fail as their profile
+// says.
+class HostedVendor
+{
+public:
+	typedef std::chrono::steady_clock clock;
+
+	explicit HostedVendor(const std::string& address);
+	virtual ~HostedVendor() {}
+	const std::string& id() const;
+	vendor::Vendor::AsyncService& service();
+
+	// Whether calls can take a while or fail. Calls to a vendor that cannot
+	// are answered as soon as they arrive.
+	virtual bool Emulated() const;
+	// How long to take over a call asking for "bids" bids
+	virtual clock::duration Delay(int bids);
+	// Whether to fail the call being answered
+	virtual bool InjectError();
+
+	void Answer(const vendor::BidQuery& request, vendor::BidReply* reply) const;
+	void Answer(const vendor::BidBatchQuery& request, vendor::BidBatchReply* reply) const;
+
+private:
+	double Price(const std::string& product_name) const;
+
+	const std::string id_;
+	vendor::Vendor::AsyncService service_;
+};
+
+// One call to a hosted vendor on one completion queue. Puts the next call in
+// place as soon as its request arrives, waits as long as the vendor says,
+// answers, and deletes itself once nothing of it is outstanding. A waiting
+// call whose client gives up stops waiting at once.
+template<class Request, class Reply>
+class VendorCall : public CompletionTag
+{
+public:
+	typedef void (vendor::Vendor::AsyncService::*RequestMethod)(
+		grpc::ServerContext*, Request*, grpc::ServerAsyncResponseWriter<Reply>*, grpc::CompletionQueue*,
+		grpc::ServerCompletionQueue*, void*);
+
+	VendorCall(HostedVendor* vendor, RequestMethod method, grpc::ServerCompletionQueue* cq);
+	void Proceed(bool ok) override;
+
+private:
+	// Fires once the call is over, answered or not
+	struct Done : public CompletionTag {
+		explicit Done(VendorCall* call) : call(call) {}
+		void Proceed(bool) override { call->OnDone(); }
+		VendorCall* call;
+	};
+
+	enum State { REQUEST, DELAY, FINISH };
+
+	void Answer();
+	void OnDone();
+	void Unref();
+
+	HostedVendor* vendor_;
+	RequestMethod method_;
+	grpc::ServerCompletionQueue* cq_;
+	grpc::ServerContext ctx_;
+	Request request_;
+	Reply reply_;
+	grpc::ServerAsyncResponseWriter<Reply> responder_;
+	grpc::Alarm alarm_;
+	Done done_;
+	// Keeps the wait and the client giving up from crossing
+	std::mutex mutex_;
+	State state_;
+	bool cancelled_;
+	// The call's own operation in flight, plus the done notification for a
+	// vendor that can make calls wait
+	std::atomic<int> refs_;
+};
+
+inline int BidsIn(const vendor::BidQuery&) {
+	return 1;
+}
+
+inline int BidsIn(const vendor::BidBatchQuery& request) {
+	return request.product_names_size();
+}
+
+inline HostedVendor::HostedVendor(const std::string& address) : id_("Vendor_" + address) {}
+
+inline const std::string& HostedVendor::id() const {
+	return id_;
+}
+
+inline vendor::Vendor::AsyncService& HostedVendor::service() {
+	return service_;
+}
+
+inline bool HostedVendor::Emulated() const {
+	return false;
+}
+
+inline HostedVendor::clock::duration HostedVendor::Delay(int) {
+	return clock::duration::zero();
+}
+
+inline bool HostedVendor::InjectError() {
+	return false;
+}
+
+inline double HostedVendor::Price(const std::string& product_name) const {
+	return std::hash<std::string>()(id_ + product_name) % 100;
+}
+
+inline void HostedVendor::Answer(const vendor::BidQuery& request, vendor::BidReply* reply) const {
+	reply->set_price(Price(request.product_name()));
+	reply->set_vendor_id(id_);
+}
+
+inline void HostedVendor::Answer(const vendor::BidBatchQuery& request, vendor::BidBatchReply* reply) const {
+	for (int i = 0; i < request.product_names_size(); ++i) {
+		vendor::BidReply* bid = reply->add_bids();
+		bid->set_price(Price(request.product_names(i)));
+		bid->set_vendor_id(id_);
+	}
+}
+
+template<class Request, class Reply>
+VendorCall<Request, Reply>::VendorCall(HostedVendor* vendor, RequestMethod method, grpc::ServerCompletionQueue* cq)
+	: vendor_(vendor), method_(method), cq_(cq), responder_(&ctx_), done_(this), state_(REQUEST), cancelled_(false),
+	  refs_(1) {
+	if (vendor_->Emulated()) {
+		ctx_.AsyncNotifyWhenDone(static_cast<CompletionTag*>(&done_));
+		refs_ = 2;
+	}
+	(vendor_->service().*method_)(&ctx_, &request_, &responder_, cq_, cq_, static_cast<CompletionTag*>(this));
+}
+
+template<class Request, class Reply>
+void VendorCall<Request, Reply>::Proceed(bool ok) {
+	if (state_ == REQUEST) {
+		if (!ok) {
+			// Shutting down. The call never started, so it never ends either.
+			delete this;
+			return;
+		}
+		new VendorCall(vendor_, method_, cq_);
+		if (!vendor_->Emulated()) {
+			Answer();
+			return;
+		}
+		HostedVendor::clock::duration delay = vendor_->Delay(BidsIn(request_));
+		bool waiting;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			waiting = !cancelled_;
+			if (waiting) {
+				state_ = DELAY;
+				alarm_.Set(cq_, std::chrono::system_clock::now() + delay, static_cast<CompletionTag*>(this));
+			}
+		}
+		if (!waiting) {
+			// The client gave up before we even started
+			Unref();
+		}
+	} else if (state_ == DELAY && ok) {
+		Answer();
+	} else {
+		// Answered, or the wait was cancelled along with the call
+		Unref();
+	}
+}
+
+template<class Request, class Reply>
+void VendorCall<Request, Reply>::Answer() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		state_ = FINISH;
+	}
+	if (vendor_->InjectError()) {
+		responder_.FinishWithError(grpc::Status(grpc::StatusCode::UNAVAILABLE, "injected error"),
+								   static_cast<CompletionTag*>(this));
+		return;
+	}
+	vendor_->Answer(request_, &reply_);
+	responder_.Finish(reply_, grpc::Status::OK, static_cast<CompletionTag*>(this));
+}
+
+template<class Request, class Reply>
+void VendorCall<Request, Reply>::OnDone() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (ctx_.IsCancelled()) {
+			cancelled_ = true;
+			if (state_ == DELAY) {
+				// Nobody is waiting for the answer: the alarm comes back cancelled
+				alarm_.Cancel();
+			}
+		}
+	}
+	Unref();
+}
+
+template<class Request, class Reply>
+void VendorCall<Request, Reply>::Unref() {
+	if (refs_.fetch_sub(1) == 1) {
+		delete this;
+	}
+}
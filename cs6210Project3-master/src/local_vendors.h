@@ -0,0 +1,61 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+#include "hosted_vendor.h"
+
+
+// Vendors hosted by the store's own server and reached over in-process
+// channels, so a bid never leaves the process. Each vendor's service is
+// registered for its address as the host, and every call to it names that
+// address as the authority, as with the vendors run_vendors hosts. They are
+// the same hosted vendors as run_vendors', with the same prices, except that
+// they answer at once, which leaves only what the transport costs.
+class LocalVendors
+{
+public:
+	explicit LocalVendors(const std::vector<std::string>& addresses);
+	// Called before the server is built
+	void Register(grpc::ServerBuilder* builder);
+	// Starts answering bids on "cq". Called once for each completion queue.
+	void Serve(grpc::ServerCompletionQueue* cq);
+	// Opens an in-process channel to one of the vendors; serves as the
+	// registry's ChannelFactory once the server is up
+	std::shared_ptr<grpc::Channel> Connect(grpc::Server* server, const std::string& address,
+										   grpc::ChannelArguments& args, std::string* authority);
+
+private:
+	std::vector<std::string> addresses_;
+	std::vector<std::unique_ptr<HostedVendor> > vendors_;
+};
+
+inline LocalVendors::LocalVendors(const std::vector<std::string>& addresses) : addresses_(addresses) {
+	for (size_t i = 0; i < addresses_.size(); ++i) {
+		vendors_.emplace_back(new HostedVendor(addresses_[i]));
+	}
+}
+
+inline void LocalVendors::Register(grpc::ServerBuilder* builder) {
+	for (size_t i = 0; i < vendors_.size(); ++i) {
+		builder->RegisterService(addresses_[i], &vendors_[i]->service());
+	}
+}
+
+inline void LocalVendors::Serve(grpc::ServerCompletionQueue* cq) {
+	for (size_t i = 0; i < vendors_.size(); ++i) {
+		new VendorCall<vendor::BidQuery, vendor::BidReply>(vendors_[i].get(),
+														   &vendor::Vendor::AsyncService::RequestgetProductBid, cq);
+		new VendorCall<vendor::BidBatchQuery, vendor::BidBatchReply>(
+			vendors_[i].get(), &vendor::Vendor::AsyncService::RequestgetProductBids, cq);
+	}
+}
+
+inline std::shared_ptr<grpc::Channel> LocalVendors::Connect(grpc::Server* server, const std::string& address,
+															grpc::ChannelArguments& args, std::string* authority) {
+	// An in-process channel ignores a default authority
+	*authority = address;
+	return server->InProcessChannel(args);
+}
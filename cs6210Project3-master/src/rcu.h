@@ -0,0 +1,198 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// Read-copy-update for data that every request reads and that is rarely
+// replaced. A reader takes no lock and never waits. It only marks itself as
+// reading for the few instructions it takes to copy the current shared_ptr.
+// A writer swaps in the new version, then waits for every reader that might
+// still be copying the old pointer before dropping its own reference. Readers
+// that already hold the old version keep it alive for as long as they need it.
+// A writer that must not wait, such as a worker, can leave that to a
+// background thread instead.
+class RcuDomain
+{
+public:
+	static RcuDomain& instance();
+
+	// Brackets a read. Reads may not nest.
+	void ReadLock();
+	void ReadUnlock();
+	// Waits until every read that began before the call has ended
+	void Synchronize();
+	// Runs "reclaim" on the background thread once every read that began
+	// before the call has ended. Returns at once.
+	void Defer(std::function<void()> reclaim);
+
+private:
+	struct Reader {
+		// Odd while the thread is reading
+		std::atomic<unsigned> sequence;
+		// Keeps readers on different threads off each other's cache lines
+		char padding[60];
+	};
+
+	// Registers a thread's Reader on its first read and removes it when the
+	// thread exits
+	struct Registration {
+		Reader* reader;
+		Registration();
+		~Registration();
+	};
+
+	Reader& Mine();
+	// The background thread: waits out the readers for a whole batch of
+	// deferred reclamations at a time
+	void Reclaim();
+
+	std::mutex mutex_;
+	std::vector<Reader*> readers_;
+
+	std::mutex deferred_mutex_;
+	std::condition_variable deferred_cv_;
+	std::vector<std::function<void()> > deferred_;
+	bool reclaiming_ = false;
+};
+
+// A shared_ptr that readers can load without a lock while writers replace it.
+template<class T>
+class RcuPointer
+{
+public:
+	RcuPointer();
+	~RcuPointer();
+	std::shared_ptr<T> load() const;
+	// Publishes "value" and returns once no reader can still be taking the
+	// previous version
+	void store(std::shared_ptr<T> value);
+	// Publishes "value" and returns at once; the previous version is dropped
+	// later, on the domain's background thread
+	void publish(std::shared_ptr<T> value);
+
+private:
+	std::atomic<std::shared_ptr<T>*> current_;
+	// Writers take turns; readers never touch it
+	std::mutex writer_mutex_;
+};
+
+inline RcuDomain& RcuDomain::instance() {
+	// Never destroyed, so threads can still exit during static destruction
+	static RcuDomain* domain = new RcuDomain();
+	return *domain;
+}
+
+inline RcuDomain::Registration::Registration() : reader(new Reader()) {
+	reader->sequence.store(0, std::memory_order_relaxed);
+	RcuDomain& domain = instance();
+	std::lock_guard<std::mutex> lock(domain.mutex_);
+	domain.readers_.push_back(reader);
+}
+
+inline RcuDomain::Registration::~Registration() {
+	RcuDomain& domain = instance();
+	std::lock_guard<std::mutex> lock(domain.mutex_);
+	for (size_t i = 0; i < domain.readers_.size(); ++i) {
+		if (domain.readers_[i] == reader) {
+			domain.readers_[i] = domain.readers_.back();
+			domain.readers_.pop_back();
+			break;
+		}
+	}
+	delete reader;
+}
+
+inline RcuDomain::Reader& RcuDomain::Mine() {
+	static thread_local Registration registration;
+	return *registration.reader;
+}
+
+inline void RcuDomain::ReadLock() {
+	// Sequentially consistent, so the writer either sees us reading or we see
+	// its new pointer
+	Mine().sequence.fetch_add(1, std::memory_order_seq_cst);
+}
+
+inline void RcuDomain::ReadUnlock() {
+	Mine().sequence.fetch_add(1, std::memory_order_release);
+}
+
+inline void RcuDomain::Synchronize() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	for (size_t i = 0; i < readers_.size(); ++i) {
+		unsigned sequence = readers_[i]->sequence.load(std::memory_order_seq_cst);
+		if (sequence & 1) {
+			// A read lasts a handful of instructions, so this is short
+			while (readers_[i]->sequence.load(std::memory_order_acquire) == sequence) {
+				std::this_thread::yield();
+			}
+		}
+	}
+}
+
+inline void RcuDomain::Defer(std::function<void()> reclaim) {
+	std::lock_guard<std::mutex> lock(deferred_mutex_);
+	deferred_.push_back(std::move(reclaim));
+	if (!reclaiming_) {
+		reclaiming_ = true;
+		// The domain is never destroyed, so neither is its thread
+		std::thread(&RcuDomain::Reclaim, this).detach();
+	}
+	deferred_cv_.notify_one();
+}
+
+inline void RcuDomain::Reclaim() {
+	std::vector<std::function<void()> > batch;
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(deferred_mutex_);
+			deferred_cv_.wait(lock, [this] { return !deferred_.empty(); });
+			batch.swap(deferred_);
+		}
+		Synchronize();
+		for (size_t i = 0; i < batch.size(); ++i) {
+			batch[i]();
+		}
+		batch.clear();
+	}
+}
+
+template<class T>
+RcuPointer<T>::RcuPointer() : current_(new std::shared_ptr<T>()) {}
+
+template<class T>
+RcuPointer<T>::~RcuPointer() {
+	delete current_.load();
+}
+
+template<class T>
+std::shared_ptr<T> RcuPointer<T>::load() const {
+	RcuDomain& domain = RcuDomain::instance();
+	domain.ReadLock();
+	std::shared_ptr<T> value = *current_.load(std::memory_order_seq_cst);
+	domain.ReadUnlock();
+	return value;
+}
+
+template<class T>
+void RcuPointer<T>::store(std::shared_ptr<T> value) {
+	std::lock_guard<std::mutex> lock(writer_mutex_);
+	std::shared_ptr<T>* previous = current_.exchange(new std::shared_ptr<T>(std::move(value)),
+													 std::memory_order_seq_cst);
+	RcuDomain::instance().Synchronize();
+	delete previous;
+}
+
+template<class T>
+void RcuPointer<T>::publish(std::shared_ptr<T> value) {
+	std::lock_guard<std::mutex> lock(writer_mutex_);
+	std::shared_ptr<T>* previous = current_.exchange(new std::shared_ptr<T>(std::move(value)),
+													 std::memory_order_seq_cst);
+	RcuDomain::instance().Defer([previous] { delete previous; });
+}
@@ -1,4 +1,18 @@
 #include "threadpool.h"
+#include "store_options.h"
+#include "completion_tag.h"
+#include "affinity.h"
+#include "vendor_registry.h"
+#include "bid_cache.h"
+#include "fanout.h"
+#include "store_stats.h"
+#include "free_list.h"
+#include "admission.h"
+#include "rcu.h"
+#include "aggregation.h"
+#include "aggregator.h"
+#include "vendor_dictionary.h"
+#include "local_vendors.h"
 
 #include <iostream>
 #include <memory>
@@ -7,9 +21,18 @@
 #include <vector>
 #include <fstream>
 #include <chrono>
-#include <future>
+#include <functional>
 #include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <deque>
+#include <csignal>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
+#include <google/protobuf/arena.h>
+#include <grpcpp/alarm.h>
 #include <grpcpp/grpcpp.h>
 #include "store.grpc.pb.h"
 #include "vendor.grpc.pb.h"
@@ -29,27 +52,77 @@ using store::Store;
 using store::ProductQuery;
 using store::ProductReply;
 using store::ProductInfo;
+using store::ProductBatchQuery;
+using store::ProductBatchReply;
+using store::StatsQuery;
+using store::StatsReply;
 
 using vendor::BidQuery;
 using vendor::BidReply;
+using vendor::BidBatchQuery;
 using vendor::Vendor;
 
-class StoreClient;
-vendor::BidReply run_client(const std::string& server_addr, const std::string& product_name);
 std::vector<std::string> vendors;
-std::vector<std::future<int>> results;
+// Warm channels to every vendor, shared by all workers. Requests take the
+// current snapshot and keep it until they finish, so a reload never pulls a
+// vendor out from under them.
+RcuPointer<VendorRegistry> vendor_registry;
+// Recent bids per product; null when caching is off
+BidCache* bid_cache;
+// Where the store's time goes, per stage
+StoreStats* store_stats;
+// Turns new requests away under overload; null when admission control is off
+Admission* admission;
+// The child stores when this store is a root over them; null when it asks
+// the vendors itself
+ChildStores* child_stores;
+// Numbers the vendor_ids in compact replies
+VendorDictionary* vendor_dictionary;
+
+// Arena blocks for the CallData messages come from a free list too, so once
+// the store is warm a request's messages cost no malloc. Only the rare
+// allocation too big for a block goes to the heap.
+struct ArenaBlock {
+	char bytes[4096];
+};
+
+void* AllocateArenaBlock(size_t size) {
+	return size == sizeof(ArenaBlock) ? FreeList<ArenaBlock>::Allocate() : ::operator new(size);
+}
+
+void FreeArenaBlock(void* block, size_t size) {
+	if (size == sizeof(ArenaBlock)) {
+		FreeList<ArenaBlock>::Free(block);
+	} else {
+		::operator delete(block);
+	}
+}
+
+google::protobuf::ArenaOptions PooledArenaOptions() {
+	google::protobuf::ArenaOptions options;
+	options.start_block_size = sizeof(ArenaBlock);
+	options.max_block_size = sizeof(ArenaBlock);
+	options.block_alloc = &AllocateArenaBlock;
+	options.block_dealloc = &FreeArenaBlock;
+	return options;
+}
 
 class StoreServiceImpl final {
 	public:
 		~StoreServiceImpl() {
 			server_->Shutdown();
-			cq_->Shutdown();
+			for (size_t i = 0; i < cqs_.size(); ++i) {
+				cqs_[i]->Shutdown();
+			}
 		}
 
-	// There is no shutdown handling in this code.
-	void RunServer(std::string portNum, int num_threads) {
-		// Default is "0.0.0.0:50053"
-		std::string server_address("0.0.0.0:" + portNum);
+	// There is no shutdown handling in this code. With "local_vendors", the
+	// server hosts those vendors too. "started" is called once the server is
+	// up, before it serves anything.
+	void RunServer(std::string portNum, int num_threads, const StoreOptions& options, LocalVendors* local_vendors,
+				   std::function<void(grpc::Server*)> started) {
+		// Default is "0.0.0.0:50053"; a unix:PATH listens on a unix socket
+		std::string server_address(portNum.compare(0, 5, "unix:") == 0 ? portNum : "0.0.0.0:" + portNum);
 	
 		ServerBuilder builder;
 
@@ -59,223 +132,1060 @@ class StoreServiceImpl final {
 		// clients. In this case it corresponds to a *synchronous* service.
 		// builder.RegisterService(&service_);
 		builder.RegisterService(&service_);
-		// Get hold of the completion queue used for the asynchronous communication
-		// with the gRPC runtime.
-		cq_ = builder.AddCompletionQueue();
+		local_vendors_ = local_vendors;
+		if (local_vendors_) {
+			local_vendors_->Register(&builder);
+		}
+		// Get hold of the completion queues used for the asynchronous communication
+		// with the gRPC runtime, one per polling thread.
+		for (int i = 0; i < options.cqs; ++i) {
+			cqs_.push_back(builder.AddCompletionQueue());
+		}
 		// Finally assemble the server.
 		server_ = builder.BuildAndStart();
+		if (started) {
+			started(server_.get());
+		}
 		std::cout << "Server listening on " << server_address << std::endl;
-		// Create the pool of threads
-		pool = new threadpool(num_threads);
+		// Create the pool of threads, fixed or elastic
+		pool_config config;
+		config.min_threads = config.max_threads = num_threads;
+		if (options.max_threads > 0) {
+			config.min_threads = options.min_threads > 0 ? options.min_threads : std::min(num_threads, options.max_threads);
+			config.max_threads = options.max_threads;
+			config.target_wait = std::chrono::microseconds(options.target_wait_us);
+			config.idle_timeout = std::chrono::milliseconds(options.idle_timeout_ms);
+		}
+		config.cpus = options.pin_workers;
+		config.bulk_share = options.bulk_share;
+		pool = new threadpool(config);
+		if (options.admit_wait_ms > 0 || options.max_queued > 0) {
+			admission = new Admission(pool, std::chrono::milliseconds(options.admit_wait_ms), options.max_queued);
+		}
+		options_ = options;
 
-		HandleRpcs();
+		// Every completion queue gets its own polling thread; this one polls the
+		// first.
+		std::vector<std::thread> pollers;
+		for (size_t i = 1; i < cqs_.size(); ++i) {
+			pollers.emplace_back(&StoreServiceImpl::HandleRpcs, this, i);
+		}
+		HandleRpcs(0);
+		for (size_t i = 0; i < pollers.size(); ++i) {
+			pollers[i].join();
+		}
 	}
 
 	private:
+		// When to stop waiting on vendors: the client's own deadline, or our
+		// query budget if that comes first.
+		static std::chrono::system_clock::time_point QueryDeadline(const ServerContext& ctx,
+																   const StoreOptions& options) {
+			std::chrono::system_clock::time_point deadline = ctx.deadline();
+			if (options.query_budget_ms > 0) {
+				deadline = std::min(deadline, std::chrono::system_clock::now() +
+									std::chrono::milliseconds(options.query_budget_ms));
+			}
+			return deadline;
+		}
+
 		// Class encompassing the state and logic needed to serve a request.
-		class CallData {
+		// It never blocks: the vendor calls are issued on the server's own
+		// completion queue, and their completions drive the state machine forward
+		// from the same event loop as the incoming requests.
+		class CallData : public CompletionTag, public BidWaiter, public FanoutListener {
 			public:
 				// Take in the "service" instance (in this case representing an asynch server) 
 				// and the completion "cq" used for asynch comm with the gRPC runtime.
 				// called an initialization list
-				CallData(Store::AsyncService* service, ServerCompletionQueue* cq) 
-					: service_(service), cq_(cq), responder_(&ctx_), status_(CREATE) {
+				CallData(Store::AsyncService* service, ServerCompletionQueue* cq, const StoreOptions* options) 
+					: service_(service), cq_(cq), options_(options), arena_(PooledArenaOptions()),
+					  request_(google::protobuf::Arena::CreateMessage<ProductQuery>(&arena_)),
+					  reply_(google::protobuf::Arena::CreateMessage<ProductReply>(&arena_)),
+					  responder_(&ctx_), fanout_(this, cq), refs_(1), leader_(false), rejected_(false),
+					  answered_(0), replied_(false), status_(CREATE) {
 					// Invoke the serving logic right away
-					Proceed();
+					Proceed(true);
 				}
 
-			void Proceed() {
+			void Proceed(bool ok) override {
 				if (status_ == CREATE) {
-					std::cout << "Creating!!!" << std::endl;
-					// Make this instance progress to the PROCESS state.
-					status_ = PROCESS;
+					// Make this instance progress to the FANOUT state.
+					status_ = FANOUT;
 
 					// As part of the initial CREATE state, we *request* that the system
 					// start processing ProductQuery requests. In this request, "this" acts are
 					// the tag uniquely identifying the request (so that different CallData
 					// instances can serve different requests concurrently), in this case
 					// the memory address of this CallData instance.
-					service_->RequestgetProducts(&ctx_, &request_, &responder_, cq_, cq_,
-												this);
-				} else if (status_ == PROCESS) {
+					service_->RequestgetProducts(&ctx_, request_, &responder_, cq_, cq_,
+												static_cast<CompletionTag*>(this));
+				} else if (status_ == FANOUT) {
+					if (!ok) {
+						// The server is shutting down and no request arrived.
+						delete this;
+						return;
+					}
 					// Spawn a new CallData instance to serve new clients while we process
 					// the one for this CallData. The instance will deallocate itself as
 					// part of its FINISH state.
-					// Upon receiving a client request, store will assign a thread the
-					// thread pool to the incoming request for processing
-					new CallData(service_, cq_);
-
-					// The actual processing
-					std::string product = request_.product_name();
-					// std::vector<Bid> vBid;
-					// std::cout << "product: " << product << std::endl;
-					// Client to Vendor
-					// Build a Queue of products?
-					// Here is where the work should be passed to a thread worker
-					std::thread::id t_id = std::this_thread::get_id();
-					// std::cout << "T_id: " << t_id << std::endl;
-					for (int i = 0; i < vendors.size(); ++i)
-					{
-						BidReply bid;
-						bid = run_client(vendors[i], product);
-						// std::cout << "Bid Price: " << bid.price() << std::endl;
-						ProductInfo* product_info = reply_.add_products();
-						product_info->set_price(bid.price());
-						product_info->set_vendor_id(bid.vendor_id());
+					new CallData(service_, cq_, options_);
+					vendors_ = vendor_registry.load();
+					started_ = StoreStats::clock::now();
+
+					const std::string& product = request_->product_name();
+					std::vector<size_t> to_ask;
+					if (bid_cache) {
+						// Fresh cached bids go straight into the reply; only vendors
+						// whose bids are stale get asked again. Cached bids count
+						// towards a quorum.
+						bool fresh = bid_cache->Lookup(product, *vendors_, reply_, &to_ask);
+						answered_ = CountWithinPrice(*request_, *reply_);
+						if (fresh || (quorum() > 0 && answered_ >= quorum())) {
+							SendReply();
+							return;
+						}
+						status_ = AWAIT_VENDORS;
+						// A quorum request does not wait for every vendor, so it must
+						// not hand its reply to requests that would.
+						if (quorum() == 0) {
+							// Set up before joining, since the leader may hand us its
+							// reply as soon as we have joined
+							std::chrono::system_clock::time_point deadline = QueryDeadline(ctx_, *options_);
+							bool timed = deadline != std::chrono::system_clock::time_point::max();
+							stale_ = to_ask;
+							// The deadline alarm holds a reference until it comes back
+							refs_ = timed ? 2 : 1;
+							if (!bid_cache->Join(product, this)) {
+								// Someone is already fetching this product; OnBids is
+								// called with their result, unless our own deadline
+								// comes first.
+								if (timed) {
+									bool armed = false;
+									{
+										std::lock_guard<std::mutex> lock(reply_mutex_);
+										if (!replied_) {
+											leader_late_.owner = this;
+											leader_late_.alarm.Set(cq_, deadline, static_cast<CompletionTag*>(&leader_late_));
+											armed = true;
+										}
+									}
+									if (!armed) {
+										Unref();
+									}
+								}
+								return;
+							}
+							leader_ = true;
+						}
+					} else {
+						for (size_t i = 0; i < vendors_->size(); ++i) {
+							to_ask.push_back(i);
+						}
 					}
-					
-					
-					// And we are done! Let the gRPC runtime know we've finished, using the
-					// memory address of this instance as the uniquely identifying tag for
-					// the event.
-					status_ = FINISH;
-					responder_.Finish(reply_, Status::OK, this);
+
+					// Client to Vendor: every vendor is asked at once
+					std::chrono::system_clock::time_point deadline = QueryDeadline(ctx_, *options_);
+					// The fan-out holds a reference until its last completion is back
+					refs_ = 2;
+					status_ = AWAIT_VENDORS;
+					fanout_.Start(product, *vendors_, to_ask, deadline, options_->hedge);
 				} else {
 					GPR_ASSERT(status_ == FINISH);
-					// Once in the FINISH state, deallocate ourselves (CallData).
-					delete this;
+					if (!rejected_) {
+						StoreStats::clock::time_point now = StoreStats::clock::now();
+						store_stats->Record(STAGE_FINISH, now - finish_started_);
+						store_stats->Record(STAGE_TOTAL, now - started_);
+					}
+					// Once in the FINISH state, deallocate ourselves (CallData)
+					// unless a cancelled vendor call has yet to come back.
+					Unref();
+				}
+			}
+
+			// CallData objects are recycled through per-thread free lists rather
+			// than going back to malloc.
+			static void* operator new(size_t size) {
+				// The free lists hand out blocks of exactly this size
+				GPR_ASSERT(size == sizeof(CallData));
+				return FreeList<CallData>::Allocate();
+			}
+
+			static void operator delete(void* block) {
+				FreeList<CallData>::Free(block);
+			}
+
+			Priority priority() const override {
+				return status_ == FANOUT ? RequestPriority(ctx_, PRIORITY_INTERACTIVE) : PRIORITY_CONTINUATION;
+			}
+
+			// FANOUT, but the store is too busy: refuse before going near the vendors.
+			void Reject() override {
+				new CallData(service_, cq_, options_);
+				rejected_ = true;
+				status_ = FINISH;
+				responder_.FinishWithError(Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "store overloaded"),
+										   static_cast<CompletionTag*>(this));
+			}
+
+			// Another request fetched our product for us.
+			void OnBids(const ProductReply& reply) override {
+				// The reply may be sent and finished before we let go of the lock
+				++refs_;
+				{
+					std::lock_guard<std::mutex> lock(reply_mutex_);
+					reply_->CopyFrom(reply);
+					SendReply();
+					leader_late_.alarm.Cancel();
 				}
+				Unref();
 			}
 
 		private:
+			// Fires at a follower's own deadline if the request it joined has
+			// not answered by then
+			struct LeaderLate : public CompletionTag {
+				CallData* owner;
+				grpc::Alarm alarm;
+				void Proceed(bool ok) override {
+					owner->OnLeaderLate(ok);
+				}
+			};
+
+			size_t quorum() const {
+				return request_->min_responses();
+			}
+
+			// Not ok means the leader answered first and the alarm was cancelled.
+			// Otherwise stop waiting and reply with the cached bids, naming the
+			// vendors still being asked as missing.
+			void OnLeaderLate(bool ok) {
+				if (ok && bid_cache->Leave(request_->product_name(), this)) {
+					std::lock_guard<std::mutex> lock(reply_mutex_);
+					for (size_t i = 0; i < stale_.size(); ++i) {
+						reply_->add_missing_vendors((*vendors_)[stale_[i]].address());
+					}
+					SendReply();
+				}
+				Unref();
+			}
+
+			// AWAIT_VENDORS: collate one vendor's answer as it lands.
+			void OnBid(size_t vendor, const BidReply& bid) override {
+				StoreStats::clock::time_point start = StoreStats::clock::now();
+				bool quorate = false;
+				{
+					std::lock_guard<std::mutex> lock(reply_mutex_);
+					if (bid_cache) {
+						// Even bids that come in after a quorum reply are worth caching
+						ProductInfo product_info;
+						product_info.set_price(bid.price());
+						product_info.set_vendor_id(bid.vendor_id());
+						fetched_.push_back(std::make_pair((*vendors_)[vendor].address(), product_info));
+					}
+					if (replied_) {
+						return;
+					}
+					ProductInfo* product_info = reply_->add_products();
+					product_info->set_price(bid.price());
+					product_info->set_vendor_id(bid.vendor_id());
+					quorate = quorum() > 0 && WithinPrice(*request_, bid.price()) && ++answered_ == quorum();
+					if (quorate) {
+						SendReply();
+					}
+				}
+				store_stats->Record(STAGE_COLLATE, StoreStats::clock::now() - start);
+				if (quorate) {
+					// Nobody is waiting for the other vendors any more
+					fanout_.Cancel();
+				}
+			}
+
+			// A vendor that failed or ran out of time is left out of the reply
+			// and named in it instead.
+			void OnMissing(size_t vendor, const Status& status) override {
+				std::lock_guard<std::mutex> lock(reply_mutex_);
+				if (replied_) {
+					return;
+				}
+				const std::string& address = (*vendors_)[vendor].address();
+				if (status.error_code() != grpc::StatusCode::DEADLINE_EXCEEDED && !IsEjected(status)) {
+					std::cout << "RPC Failed: " << address << ": " << status.error_message() << std::endl;
+				}
+				reply_->add_missing_vendors(address);
+			}
+
+			// Every vendor has answered or been given up on, so send the reply
+			// unless a quorum already has.
+			void OnFanoutDone() override {
+				if (leader_) {
+					// Cache what we fetched and share the reply with every request
+					// that joined while we were waiting.
+					bid_cache->Complete(request_->product_name(), fetched_, *reply_);
+				} else if (bid_cache && !fetched_.empty()) {
+					bid_cache->Insert(request_->product_name(), fetched_);
+				}
+				std::lock_guard<std::mutex> lock(reply_mutex_);
+				if (!replied_) {
+					SendReply();
+				}
+			}
+
+			void OnFanoutReleased() override {
+				Unref();
+			}
+
+			// Called once; where vendor callbacks may race it, with reply_mutex_
+			// held.
+			void SendReply() {
+				replied_ = true;
+				// The full reply has been shared with the cache by now, so it can
+				// be cut down to what this client asked for.
+				Aggregate(*request_, reply_);
+				if (request_->compact()) {
+					vendor_dictionary->Compact(*request_, reply_);
+				}
+				// And we are done! Let the gRPC runtime know we've finished, using the
+				// memory address of this instance as the uniquely identifying tag for
+				// the event.
+				status_ = FINISH;
+				finish_started_ = StoreStats::clock::now();
+				responder_.Finish(*reply_, Status::OK, static_cast<CompletionTag*>(this));
+			}
+
+			// Deletes us once the reply is sent and no vendor call can still
+			// come back.
+			void Unref() {
+				if (refs_.fetch_sub(1) == 1) {
+					delete this;
+				}
+			}
+
 			// The means of communication with the gRPC runtime for an async server.
 			Store::AsyncService* service_;
 			// The producer-consumer queue where for asynchronous server notifications.
 			ServerCompletionQueue* cq_;
+			const StoreOptions* options_;
 			// Context for the rpc, allowing to tweak aspects of it such as the use of
 			// compression, authentication, as well as to send metadata back to the client.
 			ServerContext ctx_;
+			// The vendor list as it was when the request arrived
+			std::shared_ptr<VendorRegistry> vendors_;
+			// Holds the request and reply, including a ProductInfo and vendor_id
+			// per vendor, in pooled blocks that are all given back at once
+			google::protobuf::Arena arena_;
 			// What we get from the client.
-			ProductQuery request_;
+			ProductQuery* request_;
 			// What we send back to the client.
-			ProductReply reply_;
+			ProductReply* reply_;
+			// Vendor replies may be collated on several workers at once
+			std::mutex reply_mutex_;
 			// The means to get back to the client.
 			ServerAsyncResponseWriter<ProductReply> responder_;
-			// The threadpool used
-			threadpool* pool_;
+			// The calls to the vendors
+			Fanout fanout_;
+			// Bids fetched for the cache, keyed by vendor address
+			std::vector<std::pair<std::string, ProductInfo> > fetched_;
+			// A follower's vendors without a fresh bid, and its deadline alarm
+			std::vector<size_t> stale_;
+			LeaderLate leader_late_;
+			// Held by the reply and by the fan-out while it has calls out
+			std::atomic<int> refs_;
+			// When a worker took up the request, and when Finish was called
+			StoreStats::clock::time_point started_;
+			StoreStats::clock::time_point finish_started_;
+			// Whether this request is the one fetching its product for the cache
+			bool leader_;
+			// Whether admission turned the request away
+			bool rejected_;
+			// Bids in the reply so far, counted towards min_responses
+			size_t answered_;
+			// Set once the reply has gone, after which later bids are ignored
+			bool replied_;
 			// Let's implement a tiny state machine with the following states.
 			enum CallStatus
 			{
-				CREATE, PROCESS, FINISH
+				CREATE, FANOUT, AWAIT_VENDORS, FINISH
 			};
 
 			CallStatus status_; // The current serving state.
 		};
 
-		// This can be run in multiple threads if needed. 
-		void HandleRpcs() {
-			// Spawn a new CallData instance to serve new clients.
-			new CallData(&service_, cq_.get());
-			void* tag; // uniquely identifies a request.
-			bool ok;
+		// Serves getProductsBatch. Each vendor gets a single getProductBids call
+		// for every product in the batch, so M products from V vendors cost V
+		// calls rather than M x V. Batches skip the bid cache and hedging, but
+		// keep the query budget.
+		class BatchCallData : public CompletionTag {
+			public:
+				BatchCallData(Store::AsyncService* service, ServerCompletionQueue* cq, const StoreOptions* options)
+					: service_(service), cq_(cq), options_(options), responder_(&ctx_), pending_(0), rejected_(false),
+					  status_(CREATE) {
+					Proceed(true);
+				}
 
-			while (true) {
-				GPR_ASSERT(cq_->Next(&tag, &ok));
-				GPR_ASSERT(ok);
-				pool->enqueue([tag](){ 
-				
-				/*
-				/ Block waiting to read the next event from the completion queue. The 
-				/ event is uniquely identified by its tag, which in this case is the 
-				/ memory address of a CallData instance. 
-				/ The return value of Next should always be checked. this return value
-				/ tells us whether there is any kind of event or cq_ is shutting down.
-				*/
-				
-				static_cast<CallData*>(tag)->Proceed();
-				// the above call to proceed can be given to a thread in the threadpool
-				});
+			void Proceed(bool ok) override {
+				if (status_ == CREATE) {
+					status_ = FANOUT;
+					service_->RequestgetProductsBatch(&ctx_, &request_, &responder_, cq_, cq_,
+													 static_cast<CompletionTag*>(this));
+				} else if (status_ == FANOUT) {
+					if (!ok) {
+						delete this;
+						return;
+					}
+					new BatchCallData(service_, cq_, options_);
+					vendors_ = vendor_registry.load();
+					started_ = StoreStats::clock::now();
+
+					BidBatchQuery query;
+					for (int i = 0; i < request_.product_names_size(); ++i) {
+						query.add_product_names(request_.product_names(i));
+						reply_.add_replies();
+					}
+					std::chrono::system_clock::time_point deadline = QueryDeadline(ctx_, *options_);
+
+					// Encoded once; every vendor is sent the same bytes
+					grpc::ByteBuffer encoded = SerializeQuery(query);
+					calls_.reset(new BatchCall[vendors_->size()]);
+					pending_ = vendors_->size() + 1;
+					status_ = AWAIT_VENDORS;
+					for (size_t i = 0; i < vendors_->size(); ++i) {
+						BatchCall& call = calls_[i];
+						call.owner = this;
+						call.vendor = i;
+						if (!vendors_->Allow(i)) {
+							AddMissing((*vendors_)[i].address());
+							Release();
+							continue;
+						}
+						if (deadline != std::chrono::system_clock::time_point::max()) {
+							call.context.set_deadline(deadline);
+						}
+						(*vendors_)[i].AsyncAskBids(encoded, cq_, &call);
+					}
+					Release();
+				} else {
+					GPR_ASSERT(status_ == FINISH);
+					if (!rejected_) {
+						StoreStats::clock::time_point now = StoreStats::clock::now();
+						store_stats->Record(STAGE_FINISH, now - finish_started_);
+						store_stats->Record(STAGE_TOTAL, now - started_);
+					}
+					delete this;
+				}
 			}
-		}
 
-		std::unique_ptr<ServerCompletionQueue> cq_;
-		Store::AsyncService service_;
-		std::unique_ptr<Server> server_;
-		threadpool* pool;
+			// Batches are bulk work unless the client says otherwise
+			Priority priority() const override {
+				return status_ == FANOUT ? RequestPriority(ctx_, PRIORITY_BULK) : PRIORITY_CONTINUATION;
+			}
 
-};
+			void Reject() override {
+				new BatchCallData(service_, cq_, options_);
+				rejected_ = true;
+				status_ = FINISH;
+				responder_.FinishWithError(Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "store overloaded"),
+										   static_cast<CompletionTag*>(this));
+			}
 
-class VendorClient
-{
-	public:
-		VendorClient(std::shared_ptr<Channel> channel);
-		vendor::BidReply AsyncAskBid(const std::string&);
+		private:
+			struct BatchCall : public AsyncBidBatchCall {
+				BatchCallData* owner;
+				size_t vendor;
+				void Proceed(bool ok) override {
+					owner->OnBatch(this, ok);
+				}
+			};
 
-	private:
-		std::unique_ptr<Vendor::Stub> stub_;
-};
+			// AWAIT_VENDORS: spread one vendor's bids over the per-product replies.
+			void OnBatch(BatchCall* call, bool ok) {
+				const std::string& address = (*vendors_)[call->vendor].address();
+				bool answered = ok && call->status.ok();
+				if (answered) {
+					vendors_->Succeeded(call->vendor);
+				} else {
+					vendors_->Failed(call->vendor);
+					if (call->status.error_code() != grpc::StatusCode::DEADLINE_EXCEEDED) {
+						std::cout << "RPC Failed: " << address << ": " << call->status.error_message() << std::endl;
+					}
+				}
+				StoreStats::clock::time_point start = StoreStats::clock::now();
+				{
+					std::lock_guard<std::mutex> lock(reply_mutex_);
+					for (int i = 0; i < reply_.replies_size(); ++i) {
+						ProductReply* product_reply = reply_.mutable_replies(i);
+						if (answered && i < call->reply.bids_size()) {
+							ProductInfo* product_info = product_reply->add_products();
+							product_info->set_price(call->reply.bids(i).price());
+							product_info->set_vendor_id(call->reply.bids(i).vendor_id());
+						} else {
+							product_reply->add_missing_vendors(address);
+						}
+					}
+				}
+				store_stats->Record(STAGE_COLLATE, StoreStats::clock::now() - start);
+				Release();
+			}
 
-vendor::BidReply run_client(const std::string& server_addr, const std::string& product_name) {
-	VendorClient vendor_client(grpc::CreateChannel(server_addr, grpc::InsecureChannelCredentials()));
-	// std::cout << "Asking the following vendor: " << server_addr << std::endl;
-	return vendor_client.AsyncAskBid(product_name);
-}
+			// A vendor that was not asked is missing from every product
+			void AddMissing(const std::string& address) {
+				std::lock_guard<std::mutex> lock(reply_mutex_);
+				for (int i = 0; i < reply_.replies_size(); ++i) {
+					reply_.mutable_replies(i)->add_missing_vendors(address);
+				}
+			}
 
-VendorClient::VendorClient(std::shared_ptr<Channel> channel)
-	: stub_(Vendor::NewStub(channel))
-	{}
+			void Release() {
+				if (pending_.fetch_sub(1) == 1) {
+					status_ = FINISH;
+					finish_started_ = StoreStats::clock::now();
+					responder_.Finish(reply_, Status::OK, static_cast<CompletionTag*>(this));
+				}
+			}
 
+			Store::AsyncService* service_;
+			ServerCompletionQueue* cq_;
+			const StoreOptions* options_;
+			ServerContext ctx_;
+			std::shared_ptr<VendorRegistry> vendors_;
+			ProductBatchQuery request_;
+			ProductBatchReply reply_;
+			std::mutex reply_mutex_;
+			ServerAsyncResponseWriter<ProductBatchReply> responder_;
+			// One call per vendor
+			std::unique_ptr<BatchCall[]> calls_;
+			// Vendor calls still to come back, plus one while they are being issued
+			std::atomic<size_t> pending_;
+			// When a worker took up the request, and when Finish was called
+			StoreStats::clock::time_point started_;
+			StoreStats::clock::time_point finish_started_;
+			// Whether admission turned the request away
+			bool rejected_;
+			enum CallStatus
+			{
+				CREATE, FANOUT, AWAIT_VENDORS, FINISH
+			};
+			CallStatus status_;
+		};
 
-// Assembles the client's payload, sends it and presents the response back from the server
-vendor::BidReply VendorClient::AsyncAskBid(const std::string& product_name) {
-	// Data sending to vendor
-	BidQuery request;
-	// std::cout << "Product: " << product_name << std::endl;
-	request.set_product_name(product_name);
+		// Serves getProductsStream. Each bid is written to the client as soon as
+		// its vendor answers. A stream allows one write in flight at a time, so
+		// bids that arrive meanwhile queue up behind it and the write completion
+		// sends the next one.
+		class StreamCallData : public CompletionTag, public FanoutListener {
+			public:
+				StreamCallData(Store::AsyncService* service, ServerCompletionQueue* cq, const StoreOptions* options)
+					: service_(service), cq_(cq), options_(options), writer_(&ctx_), fanout_(this, cq),
+					  refs_(2), writing_(false), broken_(false), fanout_done_(false), sent_(0), rejected_(false),
+					  status_(CREATE) {
+					write_done_.owner = this;
+					Proceed(true);
+				}
 
-	// Container for the data we expect from the vendor
-	BidReply reply;
+			void Proceed(bool ok) override {
+				if (status_ == CREATE) {
+					status_ = FANOUT;
+					service_->RequestgetProductsStream(&ctx_, &request_, &writer_, cq_, cq_,
+													  static_cast<CompletionTag*>(this));
+				} else if (status_ == FANOUT) {
+					if (!ok) {
+						delete this;
+						return;
+					}
+					new StreamCallData(service_, cq_, options_);
+					if (child_stores) {
+						// A root has no vendors of its own to stream bids from
+						refs_ = 1;
+						rejected_ = true;
+						status_ = FINISH;
+						writer_.Finish(Status(grpc::StatusCode::UNIMPLEMENTED, "streams are served by the child stores"),
+									   static_cast<CompletionTag*>(this));
+						return;
+					}
+					vendors_ = vendor_registry.load();
+					started_ = StoreStats::clock::now();
 
-	// Context for the client. It could be used to convey extra information to
-	// the server and/or tweak certain RPC behaviors.
-	ClientContext context;
+					const std::string& product = request_.product_name();
+					std::vector<size_t> to_ask;
+					status_ = AWAIT_VENDORS;
+					if (bid_cache) {
+						// Fresh cached bids go out first
+						ProductReply cached;
+						bid_cache->Lookup(product, *vendors_, &cached, &to_ask);
+						for (int i = 0; i < cached.products_size(); ++i) {
+							if (Send(cached.products(i))) {
+								// The cache alone met the quorum
+								to_ask.clear();
+							}
+						}
+					} else {
+						for (size_t i = 0; i < vendors_->size(); ++i) {
+							to_ask.push_back(i);
+						}
+					}
+					fanout_.Start(product, *vendors_, to_ask, QueryDeadline(ctx_, *options_), options_->hedge);
+				} else {
+					GPR_ASSERT(status_ == FINISH);
+					if (!rejected_) {
+						StoreStats::clock::time_point now = StoreStats::clock::now();
+						store_stats->Record(STAGE_FINISH, now - finish_started_);
+						store_stats->Record(STAGE_TOTAL, now - started_);
+					}
+					Unref();
+				}
+			}
 
-	// The producer-consumer queue we use to communicate asynchronously with 
-	// the gRPC runtime. 
-	CompletionQueue cq;
+			Priority priority() const override {
+				return status_ == FANOUT ? RequestPriority(ctx_, PRIORITY_INTERACTIVE) : PRIORITY_CONTINUATION;
+			}
 
-	// Storage for the status of the RPC upon completion.
-	Status status;
+			void Reject() override {
+				new StreamCallData(service_, cq_, options_);
+				// No fan-out will hold a reference
+				refs_ = 1;
+				rejected_ = true;
+				status_ = FINISH;
+				writer_.Finish(Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "store overloaded"),
+							   static_cast<CompletionTag*>(this));
+			}
+
+		private:
+			struct WriteDone : public CompletionTag {
+				StreamCallData* owner;
+				void Proceed(bool ok) override {
+					owner->OnWritten(ok);
+				}
+			};
 
-	// stub_->PrepareAsyncSayHello() creates an RPC object, returning
-	// an instance to store in "call" but does not actually start the RPC
-	// Because we are using the asynchronous API, we need to hold on to
-	// the "call" instance in order to get updates on the ongoing RPC
-	std::unique_ptr<ClientAsyncResponseReader<BidReply> > rpc(
-		stub_->PrepareAsyncgetProductBid(&context, request, &cq));
+			void OnBid(size_t vendor, const BidReply& bid) override {
+				ProductInfo product_info;
+				product_info.set_price(bid.price());
+				product_info.set_vendor_id(bid.vendor_id());
+				if (bid_cache) {
+					std::vector<std::pair<std::string, ProductInfo> > fetched;
+					fetched.push_back(std::make_pair((*vendors_)[vendor].address(), product_info));
+					bid_cache->Insert(request_.product_name(), fetched);
+				}
+				if (Send(product_info)) {
+					fanout_.Cancel();
+				}
+			}
 
-	// StartCall initiates the RPC Call
-	rpc->StartCall();
+			void OnMissing(size_t vendor, const Status& status) override {
+				if (status.error_code() != grpc::StatusCode::DEADLINE_EXCEEDED && !IsEjected(status)) {
+					std::cout << "RPC Failed: " << (*vendors_)[vendor].address() << ": "
+							  << status.error_message() << std::endl;
+				}
+			}
 
-	// Request that, upon completion of the RPC, "reply" be updated with the
-	// server's response; "status" with the indication of whether the operation
-	// was successful. Tag the request with the integer 1. 
-	rpc->Finish(&reply, &status, (void*)1); 
-	void* got_tag;
-	bool ok = false;
-	
-	// Block until the next result is available in the completion queue "cq"
-	// The return value of Next should always be checked. This return value
-	// tells us whether there is any kind of event of the cq_ is shutting down.
-	GPR_ASSERT(cq.Next(&got_tag, &ok));
-
-	//Verify that the result from "cq" corresponds, by its tag, our previous
-	// request.
-	GPR_ASSERT(got_tag == (void*)1);
-
-	//...and that the request jwas completed successfully. Note that "ok"
-	// corresponds solely to the request for updates introduced by Finish();
-	GPR_ASSERT(ok);
-
-	if(status.ok()) {
-		// std::cout << "Reply received - vendor ID: " << reply.vendor_id() << std::endl;
-		// std::cout << "Reply received - price: " << reply.price() << std::endl;
-		return reply;
-	} else {
-		std::cout << "RPC Failed" << std::endl;
-		return reply;
-	}
-}
+			// The stream ends once the last queued bid is written.
+			void OnFanoutDone() override {
+				std::lock_guard<std::mutex> lock(write_mutex_);
+				fanout_done_ = true;
+				if (!writing_) {
+					FinishLocked();
+				}
+			}
+
+			void OnFanoutReleased() override {
+				Unref();
+			}
+
+			// Queues a bid for the client unless the query leaves it out.
+			// Returns true when it is the one that meets min_responses, after
+			// which nothing more is sent. top_k does not apply to a stream,
+			// whose bids go out before the cheapest is known.
+			bool Send(const ProductInfo& product_info) {
+				std::lock_guard<std::mutex> lock(write_mutex_);
+				size_t quorum = request_.min_responses();
+				if (broken_ || !WithinPrice(request_, product_info.price()) || (quorum > 0 && sent_ >= quorum)) {
+					return false;
+				}
+				to_write_.push_back(product_info);
+				if (!writing_) {
+					writing_ = true;
+					writer_.Write(to_write_.front(), static_cast<CompletionTag*>(&write_done_));
+				}
+				return ++sent_ == quorum;
+			}
+
+			void OnWritten(bool ok) {
+				std::lock_guard<std::mutex> lock(write_mutex_);
+				to_write_.pop_front();
+				if (!ok) {
+					// The client went away; drop whatever is left
+					broken_ = true;
+					to_write_.clear();
+				}
+				if (!to_write_.empty()) {
+					writer_.Write(to_write_.front(), static_cast<CompletionTag*>(&write_done_));
+					return;
+				}
+				writing_ = false;
+				if (fanout_done_) {
+					FinishLocked();
+				}
+			}
+
+			void FinishLocked() {
+				status_ = FINISH;
+				finish_started_ = StoreStats::clock::now();
+				writer_.Finish(Status::OK, static_cast<CompletionTag*>(this));
+			}
+
+			void Unref() {
+				if (refs_.fetch_sub(1) == 1) {
+					delete this;
+				}
+			}
+
+			Store::AsyncService* service_;
+			ServerCompletionQueue* cq_;
+			const StoreOptions* options_;
+			ServerContext ctx_;
+			std::shared_ptr<VendorRegistry> vendors_;
+			ProductQuery request_;
+			grpc::ServerAsyncWriter<ProductInfo> writer_;
+			Fanout fanout_;
+			// Bids waiting to be written; the front one is being written
+			std::mutex write_mutex_;
+			std::deque<ProductInfo> to_write_;
+			WriteDone write_done_;
+			// Held by the stream's end and by the fan-out while it has calls out
+			std::atomic<int> refs_;
+			bool writing_;
+			bool broken_;
+			bool fanout_done_;
+			// Bids queued for the client, counted towards min_responses
+			size_t sent_;
+			// When a worker took up the request, and when Finish was called
+			StoreStats::clock::time_point started_;
+			StoreStats::clock::time_point finish_started_;
+			// Whether the stream was turned away before reaching the vendors
+			bool rejected_;
+			enum CallStatus
+			{
+				CREATE, FANOUT, AWAIT_VENDORS, FINISH
+			};
+			CallStatus status_;
+		};
+
+		// Serves getProducts or getProductsBatch on a root store. The query goes
+		// to every child store at once, each child answers for its own shard of
+		// the vendors, and their partial replies are merged into one. A child
+		// that fails or runs out of time is named among the missing vendors.
+		template<class Traits>
+		class AggregateCallData : public CompletionTag {
+			typedef typename Traits::Request Request;
+			typedef typename Traits::Reply Reply;
+
+			public:
+				AggregateCallData(Store::AsyncService* service, ServerCompletionQueue* cq, const StoreOptions* options)
+					: service_(service), cq_(cq), options_(options), responder_(&ctx_), refs_(1), pending_(0),
+					  rejected_(false), replied_(false), status_(CREATE) {
+					Proceed(true);
+				}
+
+			void Proceed(bool ok) override {
+				if (status_ == CREATE) {
+					status_ = FANOUT;
+					Traits::RequestCall(service_, &ctx_, &request_, &responder_, cq_,
+										static_cast<CompletionTag*>(this));
+				} else if (status_ == FANOUT) {
+					if (!ok) {
+						delete this;
+						return;
+					}
+					new AggregateCallData(service_, cq_, options_);
+					started_ = StoreStats::clock::now();
+					Traits::Prepare(request_, &reply_);
+					Traits::Forward(request_, &forwarded_);
+					status_ = AWAIT_CHILDREN;
+
+					std::chrono::system_clock::time_point deadline = QueryDeadline(ctx_, *options_);
+					auto priority = ctx_.client_metadata().find("x-priority");
+					calls_.reset(new ChildCall[child_stores->size()]);
+					// The child calls hold a reference until the last one is back,
+					// and issuing them holds one more of pending_
+					refs_ = 2;
+					pending_ = child_stores->size() + 1;
+					{
+						// A quorum reply cancels the other calls, so it must wait
+						// until they have all been started
+						std::lock_guard<std::mutex> lock(reply_mutex_);
+						for (size_t i = 0; i < child_stores->size(); ++i) {
+							ChildCall& call = calls_[i];
+							call.owner = this;
+							call.child = i;
+							call.context.set_deadline(deadline);
+							if (priority != ctx_.client_metadata().end()) {
+								call.context.AddMetadata("x-priority",
+														 std::string(priority->second.data(), priority->second.size()));
+							}
+							call.reader = Traits::Call(child_stores->stub(i), &call.context, forwarded_, cq_);
+							call.reader->StartCall();
+							call.reader->Finish(&call.reply, &call.status, static_cast<CompletionTag*>(&call));
+						}
+					}
+					Release();
+				} else {
+					GPR_ASSERT(status_ == FINISH);
+					if (!rejected_) {
+						StoreStats::clock::time_point now = StoreStats::clock::now();
+						store_stats->Record(STAGE_FINISH, now - finish_started_);
+						store_stats->Record(STAGE_TOTAL, now - started_);
+					}
+					Unref();
+				}
+			}
+
+			Priority priority() const override {
+				return status_ == FANOUT ? RequestPriority(ctx_, Traits::priority) : PRIORITY_CONTINUATION;
+			}
+
+			void Reject() override {
+				new AggregateCallData(service_, cq_, options_);
+				rejected_ = true;
+				status_ = FINISH;
+				responder_.FinishWithError(Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "store overloaded"),
+										   static_cast<CompletionTag*>(this));
+			}
+
+		private:
+			// One call to one child store
+			struct ChildCall : public CompletionTag {
+				AggregateCallData* owner;
+				size_t child;
+				ClientContext context;
+				Reply reply;
+				Status status;
+				std::unique_ptr<ClientAsyncResponseReader<Reply> > reader;
+
+				// A failed child call shows up in its status
+				void Proceed(bool /*ok*/) override {
+					owner->OnChild(this);
+				}
+			};
+
+			// AWAIT_CHILDREN: merge one child's partial reply as it lands.
+			void OnChild(ChildCall* call) {
+				StoreStats::clock::time_point start = StoreStats::clock::now();
+				{
+					std::lock_guard<std::mutex> lock(reply_mutex_);
+					if (!replied_) {
+						if (call->status.ok()) {
+							Traits::Merge(call->reply, &reply_);
+						} else {
+							const std::string& address = child_stores->address(call->child);
+							if (call->status.error_code() != grpc::StatusCode::DEADLINE_EXCEEDED) {
+								std::cout << "RPC Failed: " << address << ": " << call->status.error_message() << std::endl;
+							}
+							Traits::Missing(address, &reply_);
+						}
+						if (Traits::Quorate(request_, reply_)) {
+							SendReply();
+							// Nobody is waiting for the other children any more
+							for (size_t i = 0; i < child_stores->size(); ++i) {
+								calls_[i].context.TryCancel();
+							}
+						}
+					}
+				}
+				store_stats->Record(STAGE_COLLATE, StoreStats::clock::now() - start);
+				Release();
+			}
+
+			// Once every child call is back, sends the reply unless a quorum
+			// already has.
+			void Release() {
+				if (pending_.fetch_sub(1) != 1) {
+					return;
+				}
+				{
+					std::lock_guard<std::mutex> lock(reply_mutex_);
+					if (!replied_) {
+						SendReply();
+					}
+				}
+				Unref();
+			}
+
+			// Called once, with reply_mutex_ held.
+			void SendReply() {
+				replied_ = true;
+				Traits::Finish(request_, vendor_dictionary, &reply_);
+				status_ = FINISH;
+				finish_started_ = StoreStats::clock::now();
+				responder_.Finish(reply_, Status::OK, static_cast<CompletionTag*>(this));
+			}
+
+			void Unref() {
+				if (refs_.fetch_sub(1) == 1) {
+					delete this;
+				}
+			}
+
+			Store::AsyncService* service_;
+			ServerCompletionQueue* cq_;
+			const StoreOptions* options_;
+			ServerContext ctx_;
+			Request request_;
+			// What the children are asked
+			Request forwarded_;
+			Reply reply_;
+			// Child replies may be merged on several workers at once
+			std::mutex reply_mutex_;
+			ServerAsyncResponseWriter<Reply> responder_;
+			std::unique_ptr<ChildCall[]> calls_;
+			// Held by the reply and by the child calls while any is out
+			std::atomic<int> refs_;
+			// Child calls not yet back, plus one while they are being issued
+			std::atomic<size_t> pending_;
+			StoreStats::clock::time_point started_;
+			StoreStats::clock::time_point finish_started_;
+			bool rejected_;
+			bool replied_;
+			enum CallStatus
+			{
+				CREATE, FANOUT, AWAIT_CHILDREN, FINISH
+			};
+			CallStatus status_;
+		};
+
+		// Serves getStats from the stage and vendor histograms.
+		class StatsCallData : public CompletionTag {
+			public:
+				StatsCallData(Store::AsyncService* service, ServerCompletionQueue* cq, threadpool* pool)
+					: service_(service), cq_(cq), pool_(pool), responder_(&ctx_), status_(CREATE) {
+					Proceed(true);
+				}
+
+			void Proceed(bool ok) override {
+				if (status_ == CREATE) {
+					status_ = PROCESS;
+					service_->RequestgetStats(&ctx_, &request_, &responder_, cq_, cq_,
+											 static_cast<CompletionTag*>(this));
+				} else if (status_ == PROCESS) {
+					if (!ok) {
+						delete this;
+						return;
+					}
+					new StatsCallData(service_, cq_, pool_);
+					vendors_ = vendor_registry.load();
+					store_stats->Fill(*vendors_, &reply_);
+					reply_.set_pool_threads(pool_->size());
+					reply_.set_pool_queue_depth(pool_->queue_depth());
+					reply_.set_pool_bulk_queue_depth(pool_->bulk_queue_depth());
+					for (size_t i = 0; i < vendors_->size(); ++i) {
+						if ((*vendors_)[i].health().state() != VendorHealth::HEALTHY) {
+							reply_.add_ejected_vendors((*vendors_)[i].address());
+						}
+					}
+					if (admission) {
+						reply_.set_rejected(admission->rejected());
+					}
+					if (bid_cache) {
+						reply_.set_cache_hits(bid_cache->hits());
+						reply_.set_cache_misses(bid_cache->misses());
+						reply_.set_cache_coalesced(bid_cache->coalesced());
+					}
+					if (request_.reset()) {
+						store_stats->Clear(*vendors_);
+					}
+					status_ = FINISH;
+					responder_.Finish(reply_, Status::OK, static_cast<CompletionTag*>(this));
+				} else {
+					GPR_ASSERT(status_ == FINISH);
+					delete this;
+				}
+			}
+
+		private:
+			Store::AsyncService* service_;
+			ServerCompletionQueue* cq_;
+			threadpool* pool_;
+			ServerContext ctx_;
+			std::shared_ptr<VendorRegistry> vendors_;
+			StatsQuery request_;
+			StatsReply reply_;
+			ServerAsyncResponseWriter<StatsReply> responder_;
+			enum CallStatus
+			{
+				CREATE, PROCESS, FINISH
+			};
+			CallStatus status_;
+		};
+
+		// Runs once per completion queue, each on its own thread. A request's
+		// vendor calls go on the same queue as the request, so with inline
+		// dispatch everything about a request happens on one thread.
+		void HandleRpcs(size_t shard) {
+			ServerCompletionQueue* cq = cqs_[shard].get();
+			if (options_.pin_cqs && !PinCurrentThread(shard)) {
+				std::cerr << "Could not pin completion queue " << shard << std::endl;
+			}
+			// Spawn new CallData instances to serve new clients.
+			for (int i = 0; i < options_.calls_per_cq; ++i) {
+				if (child_stores) {
+					new AggregateCallData<ProductsTraits>(&service_, cq, &options_);
+					new AggregateCallData<BatchTraits>(&service_, cq, &options_);
+				} else {
+					new CallData(&service_, cq, &options_);
+					new BatchCallData(&service_, cq, &options_);
+				}
+				new StreamCallData(&service_, cq, &options_);
+			}
+			new StatsCallData(&service_, cq, pool);
+			if (local_vendors_) {
+				local_vendors_->Serve(cq);
+			}
+			void* tag; // uniquely identifies a request.
+			bool ok;
+
+			while (true) {
+				GPR_ASSERT(cq->Next(&tag, &ok));
+				if (options_.inline_dispatch) {
+					static_cast<CompletionTag*>(tag)->Proceed(ok);
+					continue;
+				}
+				// New requests are admitted here, before they can queue. Once in,
+				// a request's later events always go through.
+				CompletionTag* event = static_cast<CompletionTag*>(tag);
+				Priority priority = ok ? event->priority() : PRIORITY_CONTINUATION;
+				if (admission && !admission->Admit(priority)) {
+					event->Reject();
+					continue;
+				}
+				bool bulk = priority == PRIORITY_BULK;
+				StoreStats::clock::time_point dequeued = StoreStats::clock::now();
+				// Nothing waits on the result, so post() rather than enqueue():
+				// handing a tag to a worker then costs no allocation.
+				auto task = [tag, ok, dequeued, bulk](){ 
+				StoreStats::clock::duration waited = StoreStats::clock::now() - dequeued;
+				store_stats->Record(STAGE_POOL_WAIT, waited);
+				if (admission) {
+					admission->Started(bulk, waited);
+				}
+				// The worker carries the request, vendor call or timer on from here
+				static_cast<CompletionTag*>(tag)->Proceed(ok);
+				};
+				if (bulk) {
+					pool->post_bulk(task);
+				} else {
+					pool->post(task);
+				}
+				store_stats->Record(STAGE_CQ_DEQUEUE, StoreStats::clock::now() - dequeued);
+			}
+		}
+
+		std::vector<std::unique_ptr<ServerCompletionQueue> > cqs_;
+		Store::AsyncService service_;
+		std::unique_ptr<Server> server_;
+		threadpool* pool;
+		StoreOptions options_;
+		LocalVendors* local_vendors_;
+
+};
 
 // Get the vendors
 std::vector<std::string> getVendors(std::string filename) {
@@ -303,20 +1213,107 @@ std::vector<std::string> getVendors(std::string filename) {
   	}
 }
 
+// The vendors this store serves as one shard of a root's: every
+// shard_count-th one, starting with the shard_index-th
+std::vector<std::string> ShardVendors(const std::vector<std::string>& addresses, const StoreOptions& options) {
+	std::vector<std::string> shard;
+	for (size_t i = options.shard_index; i < addresses.size(); i += options.shard_count) {
+		shard.push_back(addresses[i]);
+	}
+	return shard;
+}
+
+// When the file was last changed, or zero if it cannot be read
+timespec ModifiedTime(const std::string& filename) {
+	struct stat info;
+	if (stat(filename.c_str(), &info) != 0) {
+		return timespec();
+	}
+	return info.st_mtim;
+}
+
+// Runs on its own thread, rebuilding the vendor registry when the store gets
+// SIGHUP or, with --watch_vendors_ms, when the vendor file changes. Vendors
+// still on the list keep their endpoints. New ones are connected before the
+// new list is published, so no request waits for their handshake.
+void ReloadVendors(std::string filename, StoreOptions options, HealthPolicy health) {
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGHUP);
+	timespec last_modified = ModifiedTime(filename);
+	while (true) {
+		bool reload = false;
+		if (options.watch_vendors_ms > 0) {
+			timespec timeout;
+			timeout.tv_sec = options.watch_vendors_ms / 1000;
+			timeout.tv_nsec = long(options.watch_vendors_ms % 1000) * 1000000;
+			reload = sigtimedwait(&signals, nullptr, &timeout) == SIGHUP;
+			timespec modified = ModifiedTime(filename);
+			if (modified.tv_sec != last_modified.tv_sec || modified.tv_nsec != last_modified.tv_nsec) {
+				last_modified = modified;
+				reload = true;
+			}
+		} else {
+			int signal;
+			reload = sigwait(&signals, &signal) == 0 && signal == SIGHUP;
+		}
+		if (!reload) {
+			continue;
+		}
+
+		std::vector<std::string> addresses = ShardVendors(getVendors(filename), options);
+		std::shared_ptr<VendorRegistry> current = vendor_registry.load();
+		if (addresses.empty()) {
+			// Most likely caught halfway through being rewritten
+			std::cerr << "No vendors in " << filename << ", keeping the current " << current->size() << std::endl;
+			continue;
+		}
+		if (addresses == current->addresses()) {
+			continue;
+		}
+		std::shared_ptr<VendorRegistry> next =
+			std::make_shared<VendorRegistry>(addresses, options.vendor_channels, health, current.get());
+		size_t ready = next->Connect(std::chrono::milliseconds(options.connect_timeout_ms));
+		vendor_registry.store(next);
+		std::cout << "Reloaded vendors: " << ready << " of " << next->size() << " connected" << std::endl;
+	}
+}
+
+// Lets the store hold a connection to each of a thousand or more vendors
+void RaiseFileLimit() {
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+}
+
 int main(int argc, char** argv) {
+	// SIGHUP reloads the vendors. Block it before any thread starts, so that
+	// every thread inherits the mask and only ReloadVendors takes it.
+	sigset_t reload_signals;
+	sigemptyset(&reload_signals);
+	sigaddset(&reload_signals, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &reload_signals, nullptr);
+
 	// Parse arguments then pass it to the store
+	StoreOptions options;
+	argc = options.Parse(argc, argv);
+	if (argc < 0) {
+		return EXIT_FAILURE;
+	}
 	int num_threads;
 	std::string vendorFile, portNum;
 	if (argc == 4) {
-		num_threads = std::min( 20, std::max(0,atoi(argv[1])));
+		num_threads = std::max(1,atoi(argv[1]));
 		portNum = argv[2];
 		vendorFile = std::string(argv[3]);
 	} else if (argc == 3) {
-		num_threads = std::min( 20, std::max(0,atoi(argv[1])));
+		num_threads = std::max(1,atoi(argv[1]));
 		portNum = argv[2];
 		vendorFile = "vendor_addresses.txt";
 	} else if (argc == 2) {
-		num_threads = std::min( 20, std::max(0,atoi(argv[1])));
+		num_threads = std::max(1,atoi(argv[1]));
 		portNum = "50057";
 		vendorFile = "vendor_addresses.txt";
 	} else {
@@ -324,33 +1321,58 @@ int main(int argc, char** argv) {
 		portNum = "50057";
 		vendorFile = "vendor_addresses.txt";
 	}
-	// Get the vendors
-	vendors = getVendors(vendorFile);
-	/*
-	for (int i = 0; i < vendors.size(); ++i)
-	{
-		std::cout << "Vendor ID: " << vendors[i] << std::endl;
+	RaiseFileLimit();
+	HealthPolicy health;
+	health.max_error_pct = options.eject_error_pct;
+	health.outlier_factor = options.eject_latency_factor;
+	health.eject_time = std::chrono::milliseconds(options.eject_ms);
+	health.max_eject_time = std::max(health.eject_time, std::chrono::milliseconds(options.max_eject_ms));
+	health.max_ejected_pct = options.max_ejected_pct;
+	if (options.cache_ttl_ms > 0 && options.children.empty()) {
+		bid_cache = new BidCache(std::chrono::milliseconds(options.cache_ttl_ms),
+								 size_t(options.cache_mb) << 20, options.cache_shards);
+	}
+	store_stats = new StoreStats();
+	vendor_dictionary = new VendorDictionary();
+	LocalVendors* local_vendors = nullptr;
+	std::function<void(grpc::Server*)> started;
+	if (!options.children.empty()) {
+		// A root asks its child stores rather than vendors, so it has none
+		child_stores = new ChildStores(getVendors(options.children));
+		size_t ready = child_stores->Connect(std::chrono::milliseconds(options.connect_timeout_ms));
+		std::cout << ready << " of " << child_stores->size() << " child stores connected" << std::endl;
+		vendor_registry.store(std::make_shared<VendorRegistry>(vendors, options.vendor_channels, health));
+	} else if (options.inprocess_vendors) {
+		// The vendors live in the store's own server, so their channels can
+		// only be opened once it is up. The list is fixed: a reload could not
+		// add vendors to a running server.
+		vendors = ShardVendors(getVendors(vendorFile), options);
+		local_vendors = new LocalVendors(vendors);
+		started = [local_vendors, options, health](grpc::Server* server) {
+			ChannelFactory factory = std::bind(&LocalVendors::Connect, local_vendors, server,
+											   std::placeholders::_1, std::placeholders::_2, std::placeholders::_3);
+			std::shared_ptr<VendorRegistry> registry =
+				std::make_shared<VendorRegistry>(vendors, options.vendor_channels, health, nullptr, factory);
+			// In-process channels have no connection to wait for
+			std::cout << registry->size() << " in-process vendors" << std::endl;
+			vendor_registry.store(registry);
+		};
+	} else {
+		// Get the vendors
+		vendors = ShardVendors(getVendors(vendorFile), options);
+		// Open the vendor channels once, up front, rather than per bid
+		std::shared_ptr<VendorRegistry> registry =
+			std::make_shared<VendorRegistry>(vendors, options.vendor_channels, health);
+		size_t ready = registry->Connect(std::chrono::milliseconds(options.connect_timeout_ms));
+		std::cout << ready << " of " << registry->size() << " vendors connected" << std::endl;
+		if (ready < registry->size()) {
+			registry->PrintState(std::cout);
+		}
+		vendor_registry.store(registry);
+		std::thread(ReloadVendors, vendorFile, options, health).detach();
 	}
-	*/
-	// Instantiate the client portion of the store.
-	// Test the pool
-	/*
-	for (int i = 0; i < 8; ++i)
-	{
-		results.emplace_back(pool->enqueue([i] {
-			// std::cout << "hello" << i << std::endl;
-			std::this_thread::sleep_for(std::chrono::seconds(2));
-			// std::cout << "world" << i << std::endl;
-			return i*i;
-		}));
-	};
-
-	for (auto && result: results)
-		std::cout << result.get() << ' '; 
-	std::cout << std::endl;
-	*/
 	StoreServiceImpl server;
-	server.RunServer(portNum, num_threads);
+	server.RunServer(portNum, num_threads, options, local_vendors, started);
 
 	return 0;
 }
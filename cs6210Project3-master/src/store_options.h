@@ -0,0 +1,227 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+// Tunables for the store given on the command line as --name=value. They may
+// appear anywhere; whatever is not an option is left as a positional argument.
+struct StoreOptions
+{
+	// Sub-channels opened to each vendor to spread HTTP/2 stream load
+	int vendor_channels = 1;
+	// How long startup waits for the vendor channels to become ready
+	int connect_timeout_ms = 2000;
+	// Server completion queues, each polled by its own thread
+	int cqs = 1;
+	// CallData instances waiting for a new request on each completion queue
+	int calls_per_cq = 1;
+	// Handle events on the thread that polled them instead of the threadpool
+	bool inline_dispatch = false;
+	// Pin each polling thread to its own core
+	bool pin_cqs = false;
+	// How long a cached bid stays fresh; 0 turns the bid cache off
+	int cache_ttl_ms = 0;
+	// Memory budget of the bid cache
+	int cache_mb = 64;
+	// Independently locked parts of the bid cache
+	int cache_shards = 16;
+	// Latency budget of a query; vendors that have not answered by then are
+	// left out of the reply. 0 waits for every vendor.
+	int query_budget_ms = 0;
+	// Ask a vendor again on another sub-channel once it takes longer than its
+	// recent p95, and use whichever answer comes first. Needs
+	// vendor_channels of 2 or more.
+	bool hedge = false;
+	// Elastic threadpool: with max_threads set, the pool runs between
+	// min_threads (default: the num_threads argument) and max_threads workers
+	int min_threads = 0;
+	int max_threads = 0;
+	// The pool grows when a task waits longer than this to start
+	int target_wait_us = 1000;
+	// Idle workers above min_threads exit after this long
+	int idle_timeout_ms = 5000;
+	// Turn new requests away once their lane's tasks wait longer than this to
+	// start; 0 admits everything
+	int admit_wait_ms = 0;
+	// Turn new requests away while this many tasks are queued; 0 is unbounded
+	int max_queued = 0;
+	// Workers take one task in this many from the bulk lane while it has any;
+	// 0 only runs bulk tasks when nothing else is queued
+	int bulk_share = 8;
+	// CPUs to pin the workers to, e.g. "0,2,4-7"
+	std::vector<unsigned> pin_workers;
+	// Eject a vendor once this percentage of its recent calls failed; 0, the
+	// default, never does
+	int eject_error_pct = 0;
+	// Eject a vendor whose p95 is this many times the others' median; 0, the
+	// default, never does
+	int eject_latency_factor = 0;
+	// How long a first ejection lasts; repeated ones double up to max_eject_ms
+	int eject_ms = 1000;
+	int max_eject_ms = 30000;
+	// Never eject more than this percentage of the vendors
+	int max_ejected_pct = 50;
+	// How often to check the vendor file for changes; 0 only reloads it on
+	// SIGHUP
+	int watch_vendors_ms = 0;
+	// Run as a root over the child stores listed in this file, one address
+	// per line, instead of asking vendors directly
+	std::string children;
+	// Serve only every shard_count-th vendor of the vendor file, starting
+	// with the shard_index-th, as one child of a root
+	int shard_index = 0;
+	int shard_count = 1;
+	// Host the vendors of the vendor file inside the store and reach them
+	// over in-process channels instead of the network
+	bool inprocess_vendors = false;
+
+	// Consumes the options from argv, compacting the positional arguments to
+	// the front. Returns the new argc, or -1 on an unknown or invalid option
+	// or on options that cannot be combined.
+	int Parse(int argc, char** argv);
+
+private:
+	bool Set(const std::string& name, const std::string& value);
+};
+
+inline bool ParseBool(const std::string& value) {
+	return value == "true" || value == "1" || value == "yes";
+}
+
+// Parses a list such as "0,2,4-7"
+inline bool ParseCpuList(const std::string& value, std::vector<unsigned>* cpus) {
+	cpus->clear();
+	std::stringstream list(value);
+	std::string item;
+	while (std::getline(list, item, ',')) {
+		unsigned first, last;
+		char dash;
+		std::stringstream range(item);
+		if (!(range >> first)) {
+			return false;
+		}
+		if (range >> dash) {
+			if (dash != '-' || !(range >> last) || last < first) {
+				return false;
+			}
+		} else {
+			last = first;
+		}
+		for (unsigned cpu = first; cpu <= last; ++cpu) {
+			cpus->push_back(cpu);
+		}
+	}
+	return !cpus->empty();
+}
+
+// Parses a shard such as "1/4": the second of four
+inline bool ParseShard(const std::string& value, int* index, int* count) {
+	std::stringstream shard(value);
+	char slash;
+	if (!(shard >> *index >> slash >> *count) || slash != '/') {
+		return false;
+	}
+	return *count > 0 && *index >= 0 && *index < *count;
+}
+
+inline int StoreOptions::Parse(int argc, char** argv) {
+	int kept = 1;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg(argv[i]);
+		if (arg.compare(0, 2, "--") != 0) {
+			argv[kept++] = argv[i];
+			continue;
+		}
+		size_t eq = arg.find('=');
+		std::string name = arg.substr(2, eq == std::string::npos ? std::string::npos : eq - 2);
+		std::string value = eq == std::string::npos ? "true" : arg.substr(eq + 1);
+		if (!Set(name, value)) {
+			std::cerr << "Invalid option " << arg << std::endl;
+			return -1;
+		}
+	}
+	// Admission control judges the threadpool's queues, which inline dispatch
+	// never uses
+	if (inline_dispatch && (admit_wait_ms > 0 || max_queued > 0)) {
+		std::cerr << "--admit_wait_ms and --max_queued need --dispatch=pool" << std::endl;
+		return -1;
+	}
+	// A hedge on the slow call's own connection would wait behind it
+	if (hedge && vendor_channels < 2) {
+		std::cerr << "--hedge needs --vendor_channels=2 or more" << std::endl;
+		return -1;
+	}
+	return kept;
+}
+
+inline bool StoreOptions::Set(const std::string& name, const std::string& value) {
+	if (name == "vendor_channels") {
+		vendor_channels = std::max(1, atoi(value.c_str()));
+	} else if (name == "connect_timeout_ms") {
+		connect_timeout_ms = std::max(0, atoi(value.c_str()));
+	} else if (name == "cqs") {
+		cqs = std::max(1, atoi(value.c_str()));
+	} else if (name == "calls_per_cq") {
+		calls_per_cq = std::max(1, atoi(value.c_str()));
+	} else if (name == "dispatch") {
+		if (value != "pool" && value != "inline") {
+			return false;
+		}
+		inline_dispatch = value == "inline";
+	} else if (name == "pin_cqs") {
+		pin_cqs = ParseBool(value);
+	} else if (name == "cache_ttl_ms") {
+		cache_ttl_ms = std::max(0, atoi(value.c_str()));
+	} else if (name == "cache_mb") {
+		cache_mb = std::max(1, atoi(value.c_str()));
+	} else if (name == "cache_shards") {
+		cache_shards = std::max(1, atoi(value.c_str()));
+	} else if (name == "query_budget_ms") {
+		query_budget_ms = std::max(0, atoi(value.c_str()));
+	} else if (name == "hedge") {
+		hedge = ParseBool(value);
+	} else if (name == "min_threads") {
+		min_threads = std::max(1, atoi(value.c_str()));
+	} else if (name == "max_threads") {
+		max_threads = std::max(1, atoi(value.c_str()));
+	} else if (name == "target_wait_us") {
+		target_wait_us = std::max(0, atoi(value.c_str()));
+	} else if (name == "idle_timeout_ms") {
+		idle_timeout_ms = std::max(1, atoi(value.c_str()));
+	} else if (name == "admit_wait_ms") {
+		admit_wait_ms = std::max(0, atoi(value.c_str()));
+	} else if (name == "max_queued") {
+		max_queued = std::max(0, atoi(value.c_str()));
+	} else if (name == "bulk_share") {
+		bulk_share = std::max(0, atoi(value.c_str()));
+	} else if (name == "pin_workers") {
+		return ParseCpuList(value, &pin_workers);
+	} else if (name == "eject_error_pct") {
+		eject_error_pct = std::max(0, std::min(100, atoi(value.c_str())));
+	} else if (name == "eject_latency_factor") {
+		eject_latency_factor = std::max(0, atoi(value.c_str()));
+	} else if (name == "eject_ms") {
+		eject_ms = std::max(1, atoi(value.c_str()));
+	} else if (name == "max_eject_ms") {
+		max_eject_ms = std::max(1, atoi(value.c_str()));
+	} else if (name == "max_ejected_pct") {
+		max_ejected_pct = std::max(0, std::min(100, atoi(value.c_str())));
+	} else if (name == "watch_vendors_ms") {
+		watch_vendors_ms = std::max(0, atoi(value.c_str()));
+	} else if (name == "inprocess_vendors") {
+		inprocess_vendors = ParseBool(value);
+	} else if (name == "children") {
+		children = value;
+		return !children.empty();
+	} else if (name == "shard") {
+		return ParseShard(value, &shard_index, &shard_count);
+	} else {
+		return false;
+	}
+	return true;
+}
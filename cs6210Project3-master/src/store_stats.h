@@ -0,0 +1,129 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "store.grpc.pb.h"
+#include "histogram.h"
+#include "vendor_registry.h"
+
+
+// The stages of a request's life that the store times
+enum Stage
+{
+	// From the poller dequeuing an event to handing it to a worker
+	STAGE_CQ_DEQUEUE,
+	// From being handed to the threadpool to a worker running it
+	STAGE_POOL_WAIT,
+	// Adding one vendor's bid to the reply, including waiting for its lock
+	STAGE_COLLATE,
+	// From calling Finish to the reply having been sent
+	STAGE_FINISH,
+	// From a worker taking up the request to the reply having been sent
+	STAGE_TOTAL,
+	NUM_STAGES
+};
+
+inline const char* StageName(int stage) {
+	switch (stage) {
+		case STAGE_CQ_DEQUEUE: return "cq_dequeue";
+		case STAGE_POOL_WAIT: return "pool_wait";
+		case STAGE_COLLATE: return "collate";
+		case STAGE_FINISH: return "finish";
+		case STAGE_TOTAL: return "total";
+	}
+	return "unknown";
+}
+
+// Per-stage latencies of the store's requests, in microseconds. Every thread
+// records into its own histograms, so timing a stage costs two clock reads
+// and two uncontended atomic adds, plus a compare-and-swap on a new maximum.
+// The histograms are only added up when someone asks for the stats.
+class StoreStats
+{
+public:
+	typedef std::chrono::steady_clock clock;
+
+	explicit StoreStats(size_t max_threads = 64);
+	void Record(Stage stage, clock::duration elapsed);
+	// Fills in the stage summaries, then one more for the vendors' round trips,
+	// followed by each vendor's own
+	void Fill(VendorRegistry& vendors, store::StatsReply* reply);
+	void Clear(VendorRegistry& vendors);
+
+private:
+	struct PerThread {
+		Histogram stages[NUM_STAGES];
+		// Keeps neighbouring threads off each other's cache lines
+		char padding[64];
+	};
+
+	PerThread& Mine();
+
+	// Threads beyond max_threads share histograms, which is still safe
+	const size_t max_threads_;
+	std::unique_ptr<PerThread[]> threads_;
+	std::atomic<size_t> next_thread_;
+};
+
+inline void Summarize(const std::string& name, const Histogram& histogram, store::LatencySummary* summary) {
+	summary->set_name(name);
+	summary->set_count(histogram.Count());
+	summary->set_mean_us(histogram.Mean());
+	summary->set_p50_us(histogram.Percentile(50));
+	summary->set_p90_us(histogram.Percentile(90));
+	summary->set_p99_us(histogram.Percentile(99));
+	summary->set_p999_us(histogram.Percentile(99.9));
+	summary->set_max_us(histogram.Max());
+}
+
+inline StoreStats::StoreStats(size_t max_threads)
+	: max_threads_(std::max<size_t>(1, max_threads)), threads_(new PerThread[max_threads_]), next_thread_(0) {}
+
+inline StoreStats::PerThread& StoreStats::Mine() {
+	static thread_local StoreStats* owner = nullptr;
+	static thread_local PerThread* mine = nullptr;
+	if (owner != this) {
+		owner = this;
+		mine = &threads_[next_thread_.fetch_add(1, std::memory_order_relaxed) % max_threads_];
+	}
+	return *mine;
+}
+
+inline void StoreStats::Record(Stage stage, clock::duration elapsed) {
+	Mine().stages[stage].Record(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+}
+
+inline void StoreStats::Fill(VendorRegistry& vendors, store::StatsReply* reply) {
+	for (int stage = 0; stage < NUM_STAGES; ++stage) {
+		Histogram merged;
+		for (size_t i = 0; i < max_threads_; ++i) {
+			merged.Merge(threads_[i].stages[stage]);
+		}
+		Summarize(StageName(stage), merged, reply->add_stages());
+	}
+
+	Histogram all_vendors;
+	for (size_t i = 0; i < vendors.size(); ++i) {
+		// A snapshot, so the summary and the total agree
+		Histogram vendor(vendors[i].latency().histogram());
+		Summarize(vendors[i].address(), vendor, reply->add_vendors());
+		all_vendors.Merge(vendor);
+	}
+	Summarize("vendor_rtt", all_vendors, reply->add_stages());
+}
+
+inline void StoreStats::Clear(VendorRegistry& vendors) {
+	for (size_t i = 0; i < max_threads_; ++i) {
+		for (int stage = 0; stage < NUM_STAGES; ++stage) {
+			threads_[i].stages[stage].Clear();
+		}
+	}
+	for (size_t i = 0; i < vendors.size(); ++i) {
+		vendors[i].latency().histogram().Clear();
+	}
+}
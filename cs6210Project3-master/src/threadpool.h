@@ -1,6 +1,8 @@
 #pragma once
 
-#include <queue>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
 #include <vector>
 #include <thread>
 #include <condition_variable>
@@ -9,46 +11,621 @@
 #include <future>
 #include <functional>
 #include <stdexcept>
+#include <random>
+#include <type_traits>
+#include <cstddef>
+#include <new>
+#include <deque>
+#include <chrono>
 
+#include "affinity.h"
+
+
+// Chase-Lev work-stealing deque of task pointers. Only the owning worker may
+// push() and pop() at the bottom; any thread may steal() from the top.
+template<class T>
+class ws_deque
+{
+public:
+	ws_deque(int64_t capacity = 256);
+	~ws_deque();
+	void push(T* item);
+	T* pop();
+	T* steal();
+	bool empty() const;
+
+private:
+	struct ring {
+		int64_t capacity;
+		std::unique_ptr<std::atomic<T*>[]> items;
+		ring(int64_t c) : capacity(c), items(new std::atomic<T*>[c]) {}
+		T* get(int64_t i) { return items[i & (capacity - 1)].load(std::memory_order_relaxed); }
+		void put(int64_t i, T* x) { items[i & (capacity - 1)].store(x, std::memory_order_relaxed); }
+	};
+
+	std::atomic<int64_t> top;
+	std::atomic<int64_t> bottom;
+	std::atomic<ring*> array;
+	// Rings outgrown by push(). Thieves may still be reading them, so they are
+	// only freed with the deque.
+	std::vector<ring*> retired;
+};
+
+// A move-only void() callable. Callables that fit in inline_size bytes are
+// stored in place, so wrapping a lambda with a few captures never allocates;
+// bigger ones fall back to the heap.
+class small_task
+{
+public:
+	static const size_t inline_size = 48;
+
+	small_task() : ops(nullptr) {}
+	template<class F, class = typename std::enable_if<
+		!std::is_same<typename std::decay<F>::type, small_task>::value>::type>
+	small_task(F&& f);
+	small_task(small_task&& other);
+	small_task& operator=(small_task&& other);
+	small_task(const small_task&) = delete;
+	small_task& operator=(const small_task&) = delete;
+	~small_task() { reset(); }
+
+	void operator()() { ops->invoke(&storage); }
+	explicit operator bool() const { return ops != nullptr; }
+	void reset();
+
+private:
+	struct ops_table {
+		void (*invoke)(void* storage);
+		void (*move)(void* to, void* from);
+		void (*destroy)(void* storage);
+	};
+
+	template<class F>
+	struct inline_ops {
+		static void invoke(void* s) { (*static_cast<F*>(s))(); }
+		static void move(void* to, void* from) { new (to) F(std::move(*static_cast<F*>(from))); }
+		static void destroy(void* s) { static_cast<F*>(s)->~F(); }
+		static const ops_table table;
+	};
+
+	template<class F>
+	struct heap_ops {
+		static F*& ptr(void* s) { return *static_cast<F**>(s); }
+		static void invoke(void* s) { (*ptr(s))(); }
+		static void move(void* to, void* from) { new (to) F*(ptr(from)); ptr(from) = nullptr; }
+		static void destroy(void* s) { delete ptr(s); }
+		static const ops_table table;
+	};
+
+	template<class F>
+	struct fits_inline {
+		static const bool value = sizeof(F) <= inline_size
+			&& alignof(F) <= alignof(std::max_align_t)
+			&& std::is_nothrow_move_constructible<F>::value;
+	};
+
+	template<class F>
+	void construct(F&& f, std::true_type);
+	template<class F>
+	void construct(F&& f, std::false_type);
+
+	typename std::aligned_storage<inline_size, alignof(std::max_align_t)>::type storage;
+	const ops_table* ops;
+};
+
+// How an elastic pool sizes itself. A fixed pool has min_threads equal to
+// max_threads.
+struct pool_config
+{
+	int min_threads = 1;
+	int max_threads = 1;
+	// Start another worker when a task waited longer than this to run;
+	// zero never grows
+	std::chrono::microseconds target_wait = std::chrono::microseconds(0);
+	// A worker idle this long exits, as long as min_threads remain
+	std::chrono::milliseconds idle_timeout = std::chrono::milliseconds(5000);
+	// CPUs the workers are pinned to, round-robin; empty leaves them unpinned
+	std::vector<unsigned> cpus;
+	// One task in bulk_share that a worker takes comes from the bulk lane
+	// while it has any, so bulk work keeps a minimum share of the pool under
+	// sustained load; 0 only runs bulk tasks when there is nothing else
+	unsigned bulk_share = 8;
+};
 
 class threadpool
 {
 public:
-	threadpool(int num_threads);
+	// "task_slots" tasks can be queued before submitting has to allocate
+	threadpool(int num_threads, size_t task_slots = 4096);
+	threadpool(const pool_config& config, size_t task_slots = 4096);
+	// The most workers the pool can have
 	int num_threads;
+	// Workers currently running
 	int size();
+	// Tasks submitted but not yet picked up by a worker
+	long queue_depth() const;
 	template<class F, class... Args>
 	auto enqueue(F&& f, Args&&... args)
 		-> std::future<typename std::result_of<F(Args...)>::type>;
+	// Fire-and-forget submission. There is no future to fulfil, and the task
+	// is stored in a preallocated slot, so a small callable costs no malloc.
+	template<class F>
+	void post(F&& f);
+	// The same, but queued in a lower lane: workers take bulk tasks when there
+	// is nothing else to do, and otherwise one in pool_config::bulk_share
+	template<class F>
+	void post_bulk(F&& f);
+	// Bulk tasks waiting for a worker
+	long bulk_queue_depth() const;
 	~threadpool();
 
 private:
+	// A queued task. Slots come from a fixed array threaded onto a lock-free
+	// free list; only once it runs dry are they allocated one by one.
+	struct task_type {
+		small_task fn;
+		// Only stamped when the pool may grow
+		std::chrono::steady_clock::time_point submitted_at;
+		// Index + 1 of the next free slot, 0 at the end of the list
+		std::atomic<uint32_t> next_free;
+	};
+
+	struct worker_state {
+		// Tasks this worker queued itself; owner-only at the bottom
+		ws_deque<task_type> local;
+		// Tasks handed in by threads outside the pool
+		std::mutex inbox_mutex;
+		std::vector<task_type*> inbox;
+		// Lets thieves skip an empty inbox without touching its lock
+		std::atomic<size_t> inbox_size;
+		std::minstd_rand rng;
+		// Tasks taken, for the bulk lane's share
+		unsigned taken;
+		worker_state() : inbox_size(0), taken(0) { inbox.reserve(64); }
+	};
+
+	task_type* acquire_slot();
+	void release_slot(task_type* task);
+	void submit(task_type* task);
+	void wake_one();
+	task_type* find_task(size_t self);
+	task_type* take_inbox(worker_state& w);
+	task_type* take_bulk();
+	void run(size_t self);
+	void start(const pool_config& config);
+	// Starts one more worker if the pool may grow
+	void grow();
+	// Called by an idle worker with sleep_mutex held; true if it should exit
+	bool retire(size_t self);
+	bool elastic() const;
+
+	std::unique_ptr<task_type[]> slots;
+	size_t num_slots;
+	// Free slot list head: index + 1 in the low half, an ABA counter in the
+	// high half
+	std::atomic<uint64_t> free_slots;
+
 	// Keep track of threads to join them later
 	std::vector<std::thread> workers;
-	// Task Queue
-	std::queue<std::function<void()>> tasks;
+	std::vector<std::unique_ptr<worker_state> > states;
+	// Round-robin target for submissions from outside the pool
+	std::atomic<size_t> next_inbox;
+	// Tasks submitted but not yet picked up by a worker, bulk ones included
+	std::atomic<long> queued;
+	// The bulk lane: one shared FIFO, looked at once stealing found nothing or
+	// when its share is due
+	std::mutex bulk_mutex;
+	std::deque<task_type*> bulk;
+	std::atomic<long> bulk_queued;
+	// Total submissions, so a worker knows whether anything arrived while it
+	// was looking
+	std::atomic<unsigned long> submitted;
 
-	// Synchronization
-	std::mutex queue_mutex;
+	// Idle workers sleep here until there is something to steal
+	std::mutex sleep_mutex;
 	std::condition_variable condition;
+	// Workers asleep and not yet claimed by a submitter
+	std::atomic<int> sleepers;
+	// Wakeups handed out but not yet taken; guarded by sleep_mutex
+	int wakeups;
+	// Workers awake and looking for a task
+	std::atomic<int> searching;
+	bool stop;
+
+	pool_config config;
+	// Running workers are always states[0, active)
+	std::atomic<int> active;
+	// Serialises starting and retiring workers
+	std::mutex resize_mutex;
+	std::chrono::steady_clock::time_point last_grow;
 };
 
-inline threadpool::threadpool(int num_threads) {
+template<class T>
+inline ws_deque<T>::ws_deque(int64_t capacity)
+	: top(0), bottom(0), array(new ring(capacity)) {
+}
+
+template<class T>
+inline ws_deque<T>::~ws_deque() {
+	delete array.load();
+	for (size_t i = 0; i < retired.size(); ++i)
+		delete retired[i];
+}
+
+template<class T>
+inline void ws_deque<T>::push(T* item) {
+	int64_t b = bottom.load(std::memory_order_relaxed);
+	int64_t t = top.load(std::memory_order_acquire);
+	ring* a = array.load(std::memory_order_relaxed);
+	if (b - t > a->capacity - 1) {
+		ring* bigger = new ring(a->capacity * 2);
+		for (int64_t i = t; i < b; ++i)
+			bigger->put(i, a->get(i));
+		retired.push_back(a);
+		array.store(bigger, std::memory_order_release);
+		a = bigger;
+	}
+	a->put(b, item);
+	std::atomic_thread_fence(std::memory_order_release);
+	bottom.store(b + 1, std::memory_order_relaxed);
+}
+
+template<class T>
+inline T* ws_deque<T>::pop() {
+	int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+	ring* a = array.load(std::memory_order_relaxed);
+	bottom.store(b, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	int64_t t = top.load(std::memory_order_relaxed);
+	if (t > b) {
+		// Empty
+		bottom.store(b + 1, std::memory_order_relaxed);
+		return nullptr;
+	}
+	T* item = a->get(b);
+	if (t == b) {
+		// Last item: race the thieves for it
+		if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+			item = nullptr;
+		bottom.store(b + 1, std::memory_order_relaxed);
+	}
+	return item;
+}
+
+template<class T>
+inline T* ws_deque<T>::steal() {
+	int64_t t = top.load(std::memory_order_acquire);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	int64_t b = bottom.load(std::memory_order_acquire);
+	if (t >= b)
+		return nullptr;
+	ring* a = array.load(std::memory_order_acquire);
+	T* item = a->get(t);
+	if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+		return nullptr;
+	return item;
+}
+
+template<class T>
+inline bool ws_deque<T>::empty() const {
+	return top.load(std::memory_order_relaxed) >= bottom.load(std::memory_order_relaxed);
+}
+
+// The worker (if any) of a pool the calling thread belongs to
+namespace threadpool_detail {
+	struct current_worker {
+		const void* pool;
+		size_t index;
+	};
+	inline current_worker& current() {
+		static thread_local current_worker w = { nullptr, 0 };
+		return w;
+	}
+}
+
+template<class F>
+const small_task::ops_table small_task::inline_ops<F>::table = {
+	&small_task::inline_ops<F>::invoke, &small_task::inline_ops<F>::move, &small_task::inline_ops<F>::destroy
+};
+
+template<class F>
+const small_task::ops_table small_task::heap_ops<F>::table = {
+	&small_task::heap_ops<F>::invoke, &small_task::heap_ops<F>::move, &small_task::heap_ops<F>::destroy
+};
+
+template<class F, class>
+inline small_task::small_task(F&& f) : ops(nullptr) {
+	typedef typename std::decay<F>::type callable;
+	construct(std::forward<F>(f), std::integral_constant<bool, fits_inline<callable>::value>());
+}
+
+template<class F>
+inline void small_task::construct(F&& f, std::true_type) {
+	typedef typename std::decay<F>::type callable;
+	new (&storage) callable(std::forward<F>(f));
+	ops = &inline_ops<callable>::table;
+}
+
+template<class F>
+inline void small_task::construct(F&& f, std::false_type) {
+	typedef typename std::decay<F>::type callable;
+	new (&storage) callable*(new callable(std::forward<F>(f)));
+	ops = &heap_ops<callable>::table;
+}
+
+inline small_task::small_task(small_task&& other) : ops(other.ops) {
+	if (ops) {
+		ops->move(&storage, &other.storage);
+		other.reset();
+	}
+}
+
+inline small_task& small_task::operator=(small_task&& other) {
+	if (this != &other) {
+		reset();
+		ops = other.ops;
+		if (ops) {
+			ops->move(&storage, &other.storage);
+			other.reset();
+		}
+	}
+	return *this;
+}
+
+inline void small_task::reset() {
+	if (ops) {
+		ops->destroy(&storage);
+		ops = nullptr;
+	}
+}
+
+inline threadpool::threadpool(int num_threads, size_t task_slots)
+	: num_threads(num_threads), slots(new task_type[task_slots]), num_slots(task_slots), free_slots(0), next_inbox(0), queued(0), bulk_queued(0), submitted(0), sleepers(0), wakeups(0), searching(0), stop(false), active(0) {
+	pool_config fixed;
+	fixed.min_threads = fixed.max_threads = num_threads;
+	start(fixed);
+}
+
+inline threadpool::threadpool(const pool_config& config, size_t task_slots)
+	: num_threads(config.max_threads), slots(new task_type[task_slots]), num_slots(task_slots), free_slots(0), next_inbox(0), queued(0), bulk_queued(0), submitted(0), sleepers(0), wakeups(0), searching(0), stop(false), active(0) {
+	start(config);
+}
+
+inline void threadpool::start(const pool_config& config) {
+	this->config = config;
+	this->config.min_threads = std::max(1, std::min(config.min_threads, config.max_threads));
+	num_threads = std::max(this->config.min_threads, config.max_threads);
+	this->config.max_threads = num_threads;
+	for (size_t i = 0; i < num_slots; ++i)
+		release_slot(&slots[i]);
+	// Every worker the pool might ever have gets its state up front, so the
+	// states never move and idle ones can still be stolen from
 	for (int i = 0; i < num_threads; ++i)
 	{
-		workers.emplace_back([this] {
-			while(true) {
-				std::function<void()> task;
-				{
-					std::unique_lock<std::mutex> lock(this->queue_mutex);
-					this->condition.wait(lock, [this] { return !this->tasks.empty(); });
-					task = this->tasks.front();
-					this->tasks.pop();
-				}
+		states.emplace_back(new worker_state());
+		states.back()->rng.seed(i + 1);
+	}
+	workers.resize(num_threads);
+	std::lock_guard<std::mutex> lock(resize_mutex);
+	for (int i = 0; i < this->config.min_threads; ++i)
+	{
+		workers[i] = std::thread(&threadpool::run, this, i);
+		++active;
+	}
+}
+
+inline bool threadpool::elastic() const {
+	return config.min_threads < config.max_threads;
+}
+
+inline void threadpool::grow() {
+	std::unique_lock<std::mutex> lock(resize_mutex, std::try_to_lock);
+	if (!lock.owns_lock())
+		return;
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	int i = active.load();
+	// One new worker per target_wait at most, so a single slow burst does
+	// not start them all at once
+	if (i >= config.max_threads || now - last_grow < config.target_wait)
+		return;
+	// The slot's last worker has retired; it only has to finish returning
+	if (workers[i].joinable())
+		workers[i].join();
+	workers[i] = std::thread(&threadpool::run, this, i);
+	++active;
+	last_grow = now;
+}
+
+inline bool threadpool::retire(size_t self) {
+	// Only the highest running worker leaves, so the running ones stay at the
+	// front of states
+	std::unique_lock<std::mutex> lock(resize_mutex, std::try_to_lock);
+	if (!lock.owns_lock() || stop || int(self) != active.load() - 1 || active.load() <= config.min_threads)
+		return false;
+	--active;
+	return true;
+}
+
+inline void threadpool::run(size_t self) {
+	threadpool_detail::current().pool = this;
+	threadpool_detail::current().index = self;
+	if (!config.cpus.empty())
+		PinCurrentThread(config.cpus[self % config.cpus.size()]);
+	const bool timed = config.target_wait.count() > 0 && elastic();
+	// Whether this worker was woken to look for work and has not found any yet
+	bool is_searching = false;
+	while(true) {
+		// Anything submitted after this point bumps the count and wakes us
+		unsigned long seen = submitted.load();
+		task_type* task = find_task(self);
+		if (task) {
+			if (is_searching) {
+				is_searching = false;
+				// The last searcher to find work brings in another worker in case
+				// there is more
+				if (--searching == 0 && queued.load() > 0)
+					wake_one();
+			}
+			if (timed && std::chrono::steady_clock::now() - task->submitted_at > config.target_wait)
+				grow();
+			task->fn();
+			task->fn.reset();
+			release_slot(task);
+			continue;
+		}
 
-				task();
+		if (is_searching) {
+			is_searching = false;
+			--searching;
+		}
+		std::unique_lock<std::mutex> lock(this->sleep_mutex);
+		if (this->stop && this->queued.load() == 0)
+			return;
+		if (this->submitted.load() != seen)
+			continue;
+		++sleepers;
+		if (elastic()) {
+			bool retired = false;
+			while (!this->stop && this->wakeups == 0) {
+				if (this->condition.wait_for(lock, config.idle_timeout) == std::cv_status::timeout &&
+					this->wakeups == 0 && retire(self)) {
+					retired = true;
+					break;
+				}
 			}
-		});
+			if (retired) {
+				--sleepers;
+				return;
+			}
+		} else {
+			this->condition.wait(lock, [this] { return this->stop || this->wakeups > 0; });
+		}
+		// A waker claims a sleeper and counts it as searching before notifying
+		// it; a worker woken any other way does both itself
+		if (this->wakeups > 0) {
+			--wakeups;
+		} else {
+			--sleepers;
+			++searching;
+		}
+		is_searching = true;
+	}
+}
+
+// Own deque first, then own inbox, then steal from a random victim. The bulk
+// lane comes last, except for its share of the tasks.
+inline threadpool::task_type* threadpool::find_task(size_t self) {
+	worker_state& me = *states[self];
+	task_type* task = nullptr;
+	if (config.bulk_share > 0 && ++me.taken % config.bulk_share == 0)
+		task = take_bulk();
+	if (!task)
+		task = me.local.pop();
+	if (!task)
+		task = take_inbox(me);
+	if (!task) {
+		size_t n = states.size();
+		size_t start = me.rng() % n;
+		for (size_t k = 0; k < n && !task; ++k) {
+			size_t victim = (start + k) % n;
+			if (victim == self)
+				continue;
+			task = states[victim]->local.steal();
+			if (!task)
+				task = take_inbox(*states[victim]);
+		}
+	}
+	if (!task)
+		task = take_bulk();
+	if (task)
+		--queued;
+	return task;
+}
+
+inline threadpool::task_type* threadpool::take_bulk() {
+	if (bulk_queued.load(std::memory_order_relaxed) == 0)
+		return nullptr;
+	std::lock_guard<std::mutex> lock(bulk_mutex);
+	if (bulk.empty())
+		return nullptr;
+	task_type* task = bulk.front();
+	bulk.pop_front();
+	bulk_queued.store(bulk.size(), std::memory_order_relaxed);
+	return task;
+}
+
+// Takes one task from a worker's inbox. The inbox owner moves the rest onto
+// its own deque where others can steal them; thieves never block on it.
+inline threadpool::task_type* threadpool::take_inbox(worker_state& w) {
+	if (w.inbox_size.load(std::memory_order_relaxed) == 0)
+		return nullptr;
+	std::unique_lock<std::mutex> lock(w.inbox_mutex, std::try_to_lock);
+	if (!lock.owns_lock() || w.inbox.empty())
+		return nullptr;
+	task_type* task = w.inbox.back();
+	w.inbox.pop_back();
+	threadpool_detail::current_worker& me = threadpool_detail::current();
+	if (me.pool == this && &w == states[me.index].get()) {
+		for (size_t i = 0; i < w.inbox.size(); ++i)
+			w.local.push(w.inbox[i]);
+		w.inbox.clear();
+	}
+	w.inbox_size.store(w.inbox.size(), std::memory_order_relaxed);
+	return task;
+}
+
+inline threadpool::task_type* threadpool::acquire_slot() {
+	uint64_t head = free_slots.load(std::memory_order_acquire);
+	while (uint32_t index = static_cast<uint32_t>(head)) {
+		uint32_t next = slots[index - 1].next_free.load(std::memory_order_relaxed);
+		uint64_t popped = ((head >> 32) + 1) << 32 | next;
+		if (free_slots.compare_exchange_weak(head, popped, std::memory_order_acquire, std::memory_order_acquire))
+			return &slots[index - 1];
+	}
+	return new task_type();
+}
+
+inline void threadpool::release_slot(task_type* task) {
+	if (task < slots.get() || task >= slots.get() + num_slots) {
+		delete task;
+		return;
+	}
+	uint32_t index = static_cast<uint32_t>(task - slots.get()) + 1;
+	uint64_t head = free_slots.load(std::memory_order_relaxed);
+	uint64_t pushed;
+	do {
+		task->next_free.store(static_cast<uint32_t>(head), std::memory_order_relaxed);
+		pushed = ((head >> 32) + 1) << 32 | index;
+	} while (!free_slots.compare_exchange_weak(head, pushed, std::memory_order_release, std::memory_order_relaxed));
+}
+
+inline void threadpool::submit(task_type* task) {
+	threadpool_detail::current_worker& me = threadpool_detail::current();
+	if (me.pool == this) {
+		// Called from one of our workers: owner-only push, no lock
+		states[me.index]->local.push(task);
+	} else {
+		worker_state& w = *states[next_inbox.fetch_add(1, std::memory_order_relaxed) % std::max(1, active.load())];
+		std::lock_guard<std::mutex> lock(w.inbox_mutex);
+		w.inbox.push_back(task);
+		w.inbox_size.store(w.inbox.size(), std::memory_order_relaxed);
+	}
+	++queued;
+	++submitted;
+	// A worker already looking for work will find this task; only wake a
+	// sleeper when nobody is
+	if (searching.load() == 0 && sleepers.load() > 0)
+		wake_one();
+}
+
+inline void threadpool::wake_one() {
+	// Taking the lock orders us after a worker that is about to sleep
+	std::lock_guard<std::mutex> lock(sleep_mutex);
+	if (sleepers.load() > 0) {
+		--sleepers;
+		++searching;
+		++wakeups;
+		condition.notify_one();
 	}
 }
 
@@ -63,24 +640,57 @@ auto threadpool::enqueue(F&& f, Args&&... args)
 		(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
 
 	std::future<return_type> res = task->get_future();
+	post([task](){ (*task)(); });
+	return res;
+}
+
+template<class F>
+inline void threadpool::post(F&& f) {
+	task_type* slot = acquire_slot();
+	slot->fn = small_task(std::forward<F>(f));
+	if (config.target_wait.count() > 0 && elastic())
+		slot->submitted_at = std::chrono::steady_clock::now();
+	submit(slot);
+}
+
+template<class F>
+inline void threadpool::post_bulk(F&& f) {
+	task_type* slot = acquire_slot();
+	slot->fn = small_task(std::forward<F>(f));
+	if (config.target_wait.count() > 0 && elastic())
+		slot->submitted_at = std::chrono::steady_clock::now();
 	{
-		std::unique_lock<std::mutex> lock(queue_mutex);
-		tasks.emplace([task](){ (*task)(); });
+		std::lock_guard<std::mutex> lock(bulk_mutex);
+		bulk.push_back(slot);
+		bulk_queued.store(bulk.size(), std::memory_order_relaxed);
 	}
-	condition.notify_one();
-	return res;
+	++queued;
+	++submitted;
+	if (searching.load() == 0 && sleepers.load() > 0)
+		wake_one();
+}
+
+inline long threadpool::bulk_queue_depth() const {
+	return bulk_queued.load(std::memory_order_relaxed);
 }
 
 inline int threadpool::size() {
-	return num_threads;
+	return active.load();
 }
 
-// Destructor to join all threads
+inline long threadpool::queue_depth() const {
+	return std::max(0L, queued.load(std::memory_order_relaxed));
+}
+
+// Destructor to join all threads once the queued work has run
 inline threadpool::~threadpool() {
 	{
-		std::unique_lock<std::mutex> lock(queue_mutex);
+		std::unique_lock<std::mutex> lock(sleep_mutex);
+		stop = true;
 	}
 	condition.notify_all();
+	std::lock_guard<std::mutex> lock(resize_mutex);
 	for(std::thread &worker: workers)
-		worker.join();
-}
\ No newline at end of file
+		if (worker.joinable())
+			worker.join();
+}
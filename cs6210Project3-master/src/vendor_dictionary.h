@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "store.pb.h"
+#include "rcu.h"
+
+
+// Numbers every vendor_id the store has replied with, so that compact replies
+// can name a vendor by index instead of repeating its id in every bid. The
+// dictionary only grows. A client says how much of it it holds, and a reply
+// carries just the entries added since. The epoch is drawn afresh each time the
+// store starts, so a client talking to a restarted or different store is sent
+// the dictionary from the start.
+class VendorDictionary
+{
+public:
+	VendorDictionary();
+	uint64_t epoch() const;
+	// Rewrites the reply's bids as packed prices and vendor indices, adding
+	// the dictionary entries the client lacks. Taking the current dictionary
+	// costs no lock. The vendor_ids a reply has that are seen for the first
+	// time are added together, under one lock and one new version, and the
+	// old version is dropped off the calling thread.
+	void Compact(const store::ProductQuery& query, store::ProductReply* reply);
+
+private:
+	// An immutable version of the dictionary
+	struct Entries {
+		std::unordered_map<std::string, uint32_t> index;
+		std::vector<std::string> ids;
+	};
+
+	// The entries after adding whichever of "vendor_ids" are new
+	std::shared_ptr<Entries> Add(const std::vector<std::string>& vendor_ids);
+
+	const uint64_t epoch_;
+	RcuPointer<Entries> entries_;
+	std::mutex writer_mutex_;
+};
+
+// Never 0, which is what a client with no dictionary sends
+inline uint64_t NewDictionaryEpoch() {
+	std::random_device random;
+	return (uint64_t(random()) << 32 | random()) | 1;
+}
+
+inline VendorDictionary::VendorDictionary() : epoch_(NewDictionaryEpoch()) {
+	entries_.store(std::make_shared<Entries>());
+}
+
+inline uint64_t VendorDictionary::epoch() const {
+	return epoch_;
+}
+
+inline void VendorDictionary::Compact(const store::ProductQuery& query, store::ProductReply* reply) {
+	std::shared_ptr<Entries> entries = entries_.load();
+	reply->mutable_prices()->Reserve(reply->products_size());
+	reply->mutable_vendor_indices()->Reserve(reply->products_size());
+	// Bids whose vendor_id is not in the dictionary yet, and those vendor_ids
+	std::vector<int> unknown;
+	std::vector<std::string> new_ids;
+	for (int i = 0; i < reply->products_size(); ++i) {
+		const store::ProductInfo& product = reply->products(i);
+		std::unordered_map<std::string, uint32_t>::const_iterator found = entries->index.find(product.vendor_id());
+		reply->add_prices(product.price());
+		if (found == entries->index.end()) {
+			unknown.push_back(i);
+			new_ids.push_back(product.vendor_id());
+			reply->add_vendor_indices(0);
+		} else {
+			reply->add_vendor_indices(found->second);
+		}
+	}
+	if (!unknown.empty()) {
+		entries = Add(new_ids);
+		for (size_t i = 0; i < unknown.size(); ++i) {
+			reply->set_vendor_indices(unknown[i], entries->index.find(new_ids[i])->second);
+		}
+	}
+	reply->clear_products();
+
+	size_t known = query.dictionary_epoch() == epoch_ ? query.dictionary_size() : 0;
+	reply->set_dictionary_epoch(epoch_);
+	reply->set_dictionary_offset(known);
+	for (size_t i = known; i < entries->ids.size(); ++i) {
+		reply->add_vendor_ids(entries->ids[i]);
+	}
+}
+
+inline std::shared_ptr<VendorDictionary::Entries> VendorDictionary::Add(const std::vector<std::string>& vendor_ids) {
+	std::lock_guard<std::mutex> lock(writer_mutex_);
+	std::shared_ptr<Entries> current = entries_.load();
+	std::shared_ptr<Entries> next;
+	for (size_t i = 0; i < vendor_ids.size(); ++i) {
+		const Entries& latest = next ? *next : *current;
+		if (latest.index.count(vendor_ids[i])) {
+			// Someone else added it first, or it came up twice
+			continue;
+		}
+		if (!next) {
+			next = std::make_shared<Entries>(*current);
+		}
+		next->index[vendor_ids[i]] = next->ids.size();
+		next->ids.push_back(vendor_ids[i]);
+	}
+	if (!next) {
+		return current;
+	}
+	// Called on a worker, which must not wait out the readers
+	entries_.publish(next);
+	return next;
+}
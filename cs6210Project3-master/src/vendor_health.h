@@ -0,0 +1,167 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+
+// When a vendor counts as unhealthy and what is done about it
+struct HealthPolicy
+{
+	// Eject a vendor once this percentage of its recent calls failed; 0 never
+	// does
+	int max_error_pct = 0;
+	// Calls a vendor must have had before its error rate counts
+	int min_calls = 20;
+	// Eject a vendor whose p95 is this many times the median p95 of the
+	// others; 0 never does
+	int outlier_factor = 0;
+	// ...and at least this much slower, so that jitter on a fast network
+	// ejects nobody
+	std::chrono::milliseconds outlier_margin = std::chrono::milliseconds(5);
+	// How long an ejection lasts. Each ejection following soon after the last
+	// one lasts twice as long, up to max_eject_time.
+	std::chrono::milliseconds eject_time = std::chrono::milliseconds(1000);
+	std::chrono::milliseconds max_eject_time = std::chrono::milliseconds(30000);
+	// Never eject more than this percentage of the vendors, so a problem on
+	// our side cannot take them all out
+	int max_ejected_pct = 50;
+};
+
+// A circuit breaker for one vendor. Keeps the outcomes of its last calls, and
+// whether it is in use, ejected, or being probed to see if it has recovered.
+// Recording an outcome and asking a healthy vendor are lock-free; the state
+// changes, which are rare, take a lock.
+class VendorHealth
+{
+public:
+	typedef std::chrono::steady_clock clock;
+
+	enum State { HEALTHY, EJECTED, PROBING };
+
+	static const size_t window = 64;
+
+	VendorHealth();
+	State state() const;
+	// Whether the vendor may be asked now. Once an ejection has run out, one
+	// call at a time is let through as a probe, until one of them decides
+	// whether the vendor is healthy again.
+	bool Allow(clock::time_point now, const HealthPolicy& policy);
+	void Record(bool succeeded);
+	// The share of failed calls in the window, in percent; 0 until there have
+	// been min_calls calls
+	int error_pct(int min_calls) const;
+	// Takes the vendor out of use if it is in state "from", and returns how
+	// long for; zero if it was not in that state.
+	clock::duration Eject(State from, clock::time_point now, const HealthPolicy& policy);
+	// Puts a vendor being probed back into use. Returns false if it was not
+	// being probed.
+	bool Restore(clock::time_point now);
+
+private:
+	std::atomic<int> state_;
+	std::atomic<uint8_t> outcomes_[window];
+	std::atomic<uint64_t> calls_;
+	std::atomic<int> failures_;
+
+	std::mutex mutex_;
+	clock::time_point ejected_until_;
+	clock::time_point probe_started_;
+	clock::time_point restored_at_;
+	// Ejections in a row, each following soon after the last
+	int ejections_;
+
+	void ClearLocked();
+};
+
+inline VendorHealth::VendorHealth() : state_(HEALTHY), calls_(0), failures_(0), ejections_(0) {
+	for (size_t i = 0; i < window; ++i) {
+		outcomes_[i].store(0, std::memory_order_relaxed);
+	}
+}
+
+inline VendorHealth::State VendorHealth::state() const {
+	return static_cast<State>(state_.load(std::memory_order_acquire));
+}
+
+inline bool VendorHealth::Allow(clock::time_point now, const HealthPolicy& policy) {
+	if (state() == HEALTHY) {
+		return true;
+	}
+	std::lock_guard<std::mutex> lock(mutex_);
+	State current = state();
+	if (current == EJECTED && now >= ejected_until_) {
+		state_.store(PROBING, std::memory_order_release);
+		probe_started_ = now;
+		return true;
+	}
+	// A probe that never came back must not keep the vendor out for good
+	if (current == PROBING && now - probe_started_ >= policy.eject_time) {
+		probe_started_ = now;
+		return true;
+	}
+	return current == HEALTHY;
+}
+
+inline void VendorHealth::Record(bool succeeded) {
+	uint64_t n = calls_.fetch_add(1, std::memory_order_relaxed);
+	uint8_t failed = succeeded ? 0 : 1;
+	uint8_t replaced = outcomes_[n % window].exchange(failed, std::memory_order_relaxed);
+	if (failed != replaced) {
+		failures_.fetch_add(int(failed) - int(replaced), std::memory_order_relaxed);
+	}
+}
+
+inline int VendorHealth::error_pct(int min_calls) const {
+	uint64_t calls = calls_.load(std::memory_order_relaxed);
+	if (calls > window) {
+		calls = window;
+	}
+	if (calls == 0 || calls < uint64_t(min_calls)) {
+		return 0;
+	}
+	return int(std::max(0, failures_.load(std::memory_order_relaxed)) * 100 / calls);
+}
+
+inline VendorHealth::clock::duration VendorHealth::Eject(State from, clock::time_point now,
+														const HealthPolicy& policy) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (from == EJECTED || state() != from) {
+		return clock::duration::zero();
+	}
+	// A vendor that stayed healthy for a while starts over
+	if (ejections_ > 0 && from == HEALTHY && now - restored_at_ > policy.max_eject_time) {
+		ejections_ = 0;
+	}
+	clock::duration length = policy.eject_time;
+	for (int i = 0; i < ejections_ && length < policy.max_eject_time; ++i) {
+		length *= 2;
+	}
+	length = std::min<clock::duration>(length, policy.max_eject_time);
+	++ejections_;
+	ejected_until_ = now + length;
+	ClearLocked();
+	state_.store(EJECTED, std::memory_order_release);
+	return length;
+}
+
+inline bool VendorHealth::Restore(clock::time_point now) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (state() != PROBING) {
+		return false;
+	}
+	restored_at_ = now;
+	ClearLocked();
+	state_.store(HEALTHY, std::memory_order_release);
+	return true;
+}
+
+inline void VendorHealth::ClearLocked() {
+	for (size_t i = 0; i < window; ++i) {
+		outcomes_[i].store(0, std::memory_order_relaxed);
+	}
+	calls_.store(0, std::memory_order_relaxed);
+	failures_.store(0, std::memory_order_relaxed);
+}
@@ -0,0 +1,471 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+#include <grpcpp/generic/generic_stub.h>
+#include "vendor.grpc.pb.h"
+#include "completion_tag.h"
+#include "histogram.h"
+#include "vendor_health.h"
+
+
+// Vendor calls send a query encoded up front, so a query asked of every
+// vendor is encoded once rather than once per vendor. The replies are still
+// parsed as the usual messages.
+typedef grpc::TemplatedGenericStub<grpc::ByteBuffer, vendor::BidReply> RawBidStub;
+typedef grpc::TemplatedGenericStub<grpc::ByteBuffer, vendor::BidBatchReply> RawBidBatchStub;
+
+// Encodes a vendor query. Copying the result only takes another reference to
+// the same bytes, so every vendor call can send it as is.
+template<class Query>
+grpc::ByteBuffer SerializeQuery(const Query& query) {
+	grpc::ByteBuffer buffer;
+	bool own_buffer;
+	grpc::SerializationTraits<Query>::Serialize(query, &buffer, &own_buffer);
+	return buffer;
+}
+
+// State for one outstanding getProductBid call, used as its completion tag.
+// Whoever issues the call decides what happens when it completes.
+struct AsyncBidCall : public CompletionTag {
+	// Container for the data we expect from the vendor
+	vendor::BidReply reply;
+	// Context for the client. It could be used to convey extra information to
+	// the server and/or tweak certain RPC behaviors.
+	grpc::ClientContext context;
+	// Storage for the status of the RPC upon completion.
+	grpc::Status status;
+	// Because we are using the asynchronous API, we need to hold on to
+	// the "call" instance in order to get updates on the ongoing RPC
+	std::unique_ptr<grpc::ClientAsyncResponseReader<vendor::BidReply> > response_reader;
+};
+
+// The same for one getProductBids call.
+struct AsyncBidBatchCall : public CompletionTag {
+	vendor::BidBatchReply reply;
+	grpc::ClientContext context;
+	grpc::Status status;
+	std::unique_ptr<grpc::ClientAsyncResponseReader<vendor::BidBatchReply> > response_reader;
+};
+
+// Keeps a vendor's most recent round-trip times and a p95 estimate over them,
+// refreshed every few samples, plus a histogram of every round trip for the
+// stats. Recording is lock-free.
+class LatencyTracker
+{
+public:
+	static const size_t window = 128;
+	static const size_t refresh_every = 32;
+
+	LatencyTracker();
+	// Returns true when this sample refreshed the p95
+	bool Record(std::chrono::microseconds rtt);
+	// Forgets the recent samples, but not the histogram
+	void Restart();
+	// 0 until enough samples have been seen
+	std::chrono::microseconds p95() const;
+	Histogram& histogram();
+
+private:
+	Histogram histogram_;
+	std::atomic<uint32_t> samples_[window];
+	std::atomic<uint64_t> count_;
+	std::atomic<int64_t> p95_us_;
+};
+
+// Opens one sub-channel to a vendor. The default dials the vendor's address;
+// the store hands out in-process channels instead to vendors it hosts itself.
+// A factory sets "authority" if every call must name the vendor itself, as
+// over in-process channels, which send no authority of their own.
+typedef std::function<std::shared_ptr<grpc::Channel>(const std::string& address, grpc::ChannelArguments& args,
+													   std::string* authority)>
+	ChannelFactory;
+
+// Dials a vendor at a host:port or unix:PATH address
+inline std::shared_ptr<grpc::Channel> DialVendor(const std::string& address, grpc::ChannelArguments& args,
+												 std::string* /*authority*/) {
+	if (address.compare(0, 5, "unix:") == 0) {
+		// A unix socket's authority would be "localhost" for every vendor. The
+		// vendor host tells vendors apart by authority, so send the address.
+		args.SetString(GRPC_ARG_DEFAULT_AUTHORITY, address);
+	}
+	return grpc::CreateCustomChannel(address, grpc::InsecureChannelCredentials(), args);
+}
+
+// The long-lived connections to one vendor. A vendor can be given several
+// sub-channels (separate HTTP/2 connections) that bids are spread across
+// round-robin. Channels and stubs are thread-safe, so every worker shares them.
+class VendorEndpoint
+{
+public:
+	VendorEndpoint(const std::string& address, int num_channels, const ChannelFactory& factory = DialVendor);
+	const std::string& address() const;
+	// Starts an asynchronous bid request, sending "query", an encoded
+	// BidQuery, on the next sub-channel other than "avoid", when there is
+	// another. The completion is posted to "cq" tagged with "call". Returns
+	// the sub-channel used.
+	int AsyncAskBid(const grpc::ByteBuffer& query, grpc::CompletionQueue* cq, AsyncBidCall* call, int avoid = -1);
+	// The same for an encoded BidBatchQuery, asking for a batch of products in
+	// one call.
+	void AsyncAskBids(const grpc::ByteBuffer& query, grpc::CompletionQueue* cq, AsyncBidBatchCall* call);
+	// The state of the least ready sub-channel.
+	grpc_connectivity_state state(bool try_to_connect = false);
+	// Blocks until every sub-channel is READY or the deadline passes.
+	bool WaitForConnected(std::chrono::system_clock::time_point deadline);
+	// Round trips of the bids this vendor answered
+	LatencyTracker& latency();
+	VendorHealth& health();
+
+private:
+	const std::string address_;
+	// Sent with every call when the channels do not send it themselves
+	std::string authority_;
+	LatencyTracker latency_;
+	VendorHealth health_;
+	std::vector<std::shared_ptr<grpc::Channel> > channels_;
+	std::vector<std::unique_ptr<RawBidStub> > bid_stubs_;
+	std::vector<std::unique_ptr<RawBidBatchStub> > batch_stubs_;
+	std::atomic<unsigned> next_;
+};
+
+// Every vendor's endpoint: an immutable snapshot of the vendor list. When the
+// list changes a new registry is built from the old one. Vendors on both
+// lists keep their endpoint, so their channels, round-trip history and health
+// carry over.
+//
+// The registry also decides which vendors are fit to ask. Callers report how
+// each call went. A vendor whose recent calls mostly fail, or whose p95 is far
+// above everyone else's, is ejected for a while and skipped. When the
+// ejection runs out, calls are let through one at a time as probes: the first
+// to succeed puts the vendor back, and a failure ejects it again, for longer.
+// A reload can leave calls from the old snapshot still reporting back, so
+// every snapshot built from it shares its ejection lock.
+class VendorRegistry
+{
+public:
+	VendorRegistry(const std::vector<std::string>& addresses, int channels_per_vendor,
+				   const HealthPolicy& policy = HealthPolicy(), const VendorRegistry* previous = nullptr,
+				   const ChannelFactory& factory = DialVendor);
+	size_t size() const;
+	std::vector<std::string> addresses() const;
+	VendorEndpoint& operator[](size_t i);
+	// Warms up every channel, waiting at most "timeout" in total.
+	// Returns how many vendors are ready.
+	size_t Connect(std::chrono::milliseconds timeout);
+	void PrintState(std::ostream& out);
+
+	// Whether vendor i should be asked now. Every call it allows must be
+	// followed by Succeeded or Failed, unless we cancelled it ourselves.
+	bool Allow(size_t i);
+	// A call to vendor i succeeded. A non-zero "rtt" is also recorded as a
+	// round trip of a single bid.
+	void Succeeded(size_t i, std::chrono::microseconds rtt = std::chrono::microseconds::zero());
+	void Failed(size_t i);
+	// Vendors currently ejected or being probed
+	size_t ejected() const;
+
+private:
+	void Eject(size_t i, VendorHealth::State from, const std::string& reason);
+	// Ejects vendor i if its p95 is far above the median of the others'
+	void CheckOutlier(size_t i);
+
+	std::vector<std::shared_ptr<VendorEndpoint> > endpoints_;
+	const HealthPolicy policy_;
+	// Held while a healthy vendor is counted against the limit and ejected
+	std::shared_ptr<std::mutex> eject_mutex_;
+};
+
+// What a skipped vendor is reported missing with
+inline grpc::Status EjectedStatus() {
+	return grpc::Status(grpc::StatusCode::UNAVAILABLE, "vendor ejected");
+}
+
+inline bool IsEjected(const grpc::Status& status) {
+	return status.error_code() == grpc::StatusCode::UNAVAILABLE && status.error_message() == "vendor ejected";
+}
+
+inline const char* ConnectivityStateName(grpc_connectivity_state state) {
+	switch (state) {
+		case GRPC_CHANNEL_IDLE: return "IDLE";
+		case GRPC_CHANNEL_CONNECTING: return "CONNECTING";
+		case GRPC_CHANNEL_READY: return "READY";
+		case GRPC_CHANNEL_TRANSIENT_FAILURE: return "TRANSIENT_FAILURE";
+		case GRPC_CHANNEL_SHUTDOWN: return "SHUTDOWN";
+	}
+	return "UNKNOWN";
+}
+
+inline LatencyTracker::LatencyTracker() : count_(0), p95_us_(0) {
+	for (size_t i = 0; i < window; ++i) {
+		samples_[i].store(0, std::memory_order_relaxed);
+	}
+}
+
+inline bool LatencyTracker::Record(std::chrono::microseconds rtt) {
+	uint64_t n = count_.fetch_add(1, std::memory_order_relaxed);
+	uint32_t us = static_cast<uint32_t>(std::min<int64_t>(rtt.count(), UINT32_MAX));
+	samples_[n % window].store(us, std::memory_order_relaxed);
+	histogram_.Record(us);
+	if ((n + 1) % refresh_every != 0 || n + 1 < window / 4) {
+		return false;
+	}
+	// Whoever records every refresh_every'th sample recomputes the estimate
+	size_t filled = n + 1 < window ? n + 1 : window;
+	std::vector<uint32_t> recent(filled);
+	for (size_t i = 0; i < filled; ++i) {
+		recent[i] = samples_[i].load(std::memory_order_relaxed);
+	}
+	size_t rank = filled * 95 / 100;
+	std::nth_element(recent.begin(), recent.begin() + rank, recent.end());
+	p95_us_.store(recent[rank], std::memory_order_relaxed);
+	return true;
+}
+
+inline void LatencyTracker::Restart() {
+	count_.store(0, std::memory_order_relaxed);
+	p95_us_.store(0, std::memory_order_relaxed);
+}
+
+inline std::chrono::microseconds LatencyTracker::p95() const {
+	return std::chrono::microseconds(p95_us_.load(std::memory_order_relaxed));
+}
+
+inline Histogram& LatencyTracker::histogram() {
+	return histogram_;
+}
+
+inline VendorEndpoint::VendorEndpoint(const std::string& address, int num_channels, const ChannelFactory& factory)
+	: address_(address), next_(0) {
+	for (int i = 0; i < num_channels; ++i) {
+		grpc::ChannelArguments args;
+		// Without a local pool, channels with equal arguments would share one
+		// subchannel and so one connection. The index keeps them apart.
+		args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+		args.SetInt("store.vendor_subchannel", i);
+		channels_.push_back(factory(address, args, &authority_));
+		bid_stubs_.emplace_back(new RawBidStub(channels_.back()));
+		batch_stubs_.emplace_back(new RawBidBatchStub(channels_.back()));
+	}
+}
+
+inline const std::string& VendorEndpoint::address() const {
+	return address_;
+}
+
+inline int VendorEndpoint::AsyncAskBid(const grpc::ByteBuffer& query, grpc::CompletionQueue* cq, AsyncBidCall* call,
+									   int avoid) {
+	int channel = next_.fetch_add(1, std::memory_order_relaxed) % bid_stubs_.size();
+	if (channel == avoid && bid_stubs_.size() > 1) {
+		channel = (channel + 1) % bid_stubs_.size();
+	}
+	RawBidStub* stub = bid_stubs_[channel].get();
+	if (!authority_.empty()) {
+		call->context.set_authority(authority_);
+	}
+
+	// PrepareUnaryCall() creates an RPC object but does not actually start the
+	// RPC; StartCall does. The query's bytes are shared, not copied.
+	call->response_reader = stub->PrepareUnaryCall(&call->context, "/vendor.Vendor/getProductBid", query, cq);
+	call->response_reader->StartCall();
+
+	// Request that, upon completion of the RPC, "reply" be updated with the
+	// server's response; "status" with the indication of whether the operation
+	// was successful. Tag the request with the call itself.
+	call->response_reader->Finish(&call->reply, &call->status, static_cast<CompletionTag*>(call));
+	return channel;
+}
+
+inline void VendorEndpoint::AsyncAskBids(const grpc::ByteBuffer& query, grpc::CompletionQueue* cq,
+										 AsyncBidBatchCall* call) {
+	RawBidBatchStub* stub = batch_stubs_[next_.fetch_add(1, std::memory_order_relaxed) % batch_stubs_.size()].get();
+	if (!authority_.empty()) {
+		call->context.set_authority(authority_);
+	}
+	call->response_reader = stub->PrepareUnaryCall(&call->context, "/vendor.Vendor/getProductBids", query, cq);
+	call->response_reader->StartCall();
+	call->response_reader->Finish(&call->reply, &call->status, static_cast<CompletionTag*>(call));
+}
+
+inline grpc_connectivity_state VendorEndpoint::state(bool try_to_connect) {
+	grpc_connectivity_state worst = GRPC_CHANNEL_READY;
+	for (size_t i = 0; i < channels_.size(); ++i) {
+		grpc_connectivity_state s = channels_[i]->GetState(try_to_connect);
+		if (s != GRPC_CHANNEL_READY && (worst == GRPC_CHANNEL_READY || s > worst)) {
+			worst = s;
+		}
+	}
+	return worst;
+}
+
+inline LatencyTracker& VendorEndpoint::latency() {
+	return latency_;
+}
+
+inline VendorHealth& VendorEndpoint::health() {
+	return health_;
+}
+
+inline bool VendorEndpoint::WaitForConnected(std::chrono::system_clock::time_point deadline) {
+	bool ready = true;
+	for (size_t i = 0; i < channels_.size(); ++i) {
+		ready = channels_[i]->WaitForConnected(deadline) && ready;
+	}
+	return ready;
+}
+
+inline VendorRegistry::VendorRegistry(const std::vector<std::string>& addresses, int channels_per_vendor,
+									  const HealthPolicy& policy, const VendorRegistry* previous,
+									  const ChannelFactory& factory)
+	: policy_(policy), eject_mutex_(previous ? previous->eject_mutex_ : std::make_shared<std::mutex>()) {
+	for (size_t i = 0; i < addresses.size(); ++i) {
+		std::shared_ptr<VendorEndpoint> endpoint;
+		for (size_t j = 0; previous && j < previous->endpoints_.size() && !endpoint; ++j) {
+			if (previous->endpoints_[j]->address() == addresses[i]) {
+				endpoint = previous->endpoints_[j];
+			}
+		}
+		if (!endpoint) {
+			endpoint = std::make_shared<VendorEndpoint>(addresses[i], channels_per_vendor, factory);
+		}
+		endpoints_.push_back(endpoint);
+	}
+}
+
+inline size_t VendorRegistry::size() const {
+	return endpoints_.size();
+}
+
+inline std::vector<std::string> VendorRegistry::addresses() const {
+	std::vector<std::string> addresses;
+	for (size_t i = 0; i < endpoints_.size(); ++i) {
+		addresses.push_back(endpoints_[i]->address());
+	}
+	return addresses;
+}
+
+inline VendorEndpoint& VendorRegistry::operator[](size_t i) {
+	return *endpoints_[i];
+}
+
+inline size_t VendorRegistry::Connect(std::chrono::milliseconds timeout) {
+	std::chrono::system_clock::time_point deadline = std::chrono::system_clock::now() + timeout;
+	// Kick off every connection first so they are established in parallel
+	for (size_t i = 0; i < endpoints_.size(); ++i) {
+		endpoints_[i]->state(true);
+	}
+	size_t ready = 0;
+	for (size_t i = 0; i < endpoints_.size(); ++i) {
+		if (endpoints_[i]->WaitForConnected(deadline)) {
+			++ready;
+		}
+	}
+	return ready;
+}
+
+inline void VendorRegistry::PrintState(std::ostream& out) {
+	for (size_t i = 0; i < endpoints_.size(); ++i) {
+		out << "Vendor " << endpoints_[i]->address() << ": "
+			<< ConnectivityStateName(endpoints_[i]->state()) << std::endl;
+	}
+}
+
+inline bool VendorRegistry::Allow(size_t i) {
+	return endpoints_[i]->health().Allow(VendorHealth::clock::now(), policy_);
+}
+
+inline void VendorRegistry::Succeeded(size_t i, std::chrono::microseconds rtt) {
+	VendorEndpoint& endpoint = *endpoints_[i];
+	bool refreshed = rtt.count() > 0 && endpoint.latency().Record(rtt);
+	endpoint.health().Record(true);
+	if (endpoint.health().state() == VendorHealth::PROBING) {
+		if (endpoint.health().Restore(VendorHealth::clock::now())) {
+			// Its old round trips say nothing about how it is doing now
+			endpoint.latency().Restart();
+			std::cout << "Vendor " << endpoint.address() << " restored" << std::endl;
+		}
+	} else if (refreshed) {
+		CheckOutlier(i);
+	}
+}
+
+inline void VendorRegistry::Failed(size_t i) {
+	VendorHealth& health = endpoints_[i]->health();
+	health.Record(false);
+	VendorHealth::State state = health.state();
+	if (state == VendorHealth::PROBING) {
+		Eject(i, state, "probe failed");
+	} else if (state == VendorHealth::HEALTHY && policy_.max_error_pct > 0) {
+		int error_pct = health.error_pct(policy_.min_calls);
+		if (error_pct >= policy_.max_error_pct) {
+			Eject(i, state, std::to_string(error_pct) + "% of calls failed");
+		}
+	}
+}
+
+inline size_t VendorRegistry::ejected() const {
+	size_t ejected = 0;
+	for (size_t i = 0; i < endpoints_.size(); ++i) {
+		if (endpoints_[i]->health().state() != VendorHealth::HEALTHY) {
+			++ejected;
+		}
+	}
+	return ejected;
+}
+
+inline void VendorRegistry::Eject(size_t i, VendorHealth::State from, const std::string& reason) {
+	VendorEndpoint& endpoint = *endpoints_[i];
+	VendorHealth::clock::duration length;
+	if (from == VendorHealth::HEALTHY) {
+		// Count and eject under one lock, so that racing ejections cannot
+		// exceed the limit between them. The count is of the vendors ejected
+		// now, whichever snapshot ejected them.
+		std::lock_guard<std::mutex> lock(*eject_mutex_);
+		if (ejected() >= endpoints_.size() * policy_.max_ejected_pct / 100) {
+			return;
+		}
+		length = endpoint.health().Eject(from, VendorHealth::clock::now(), policy_);
+	} else {
+		length = endpoint.health().Eject(from, VendorHealth::clock::now(), policy_);
+	}
+	if (length == VendorHealth::clock::duration::zero()) {
+		// Someone else changed its state first
+		return;
+	}
+	std::cout << "Vendor " << endpoint.address() << " ejected for "
+			  << std::chrono::duration_cast<std::chrono::milliseconds>(length).count() << "ms: " << reason
+			  << std::endl;
+}
+
+inline void VendorRegistry::CheckOutlier(size_t i) {
+	if (policy_.outlier_factor <= 0) {
+		return;
+	}
+	std::chrono::microseconds mine = endpoints_[i]->latency().p95();
+	std::vector<int64_t> others;
+	for (size_t j = 0; j < endpoints_.size(); ++j) {
+		std::chrono::microseconds p95 = endpoints_[j]->latency().p95();
+		if (j != i && p95.count() > 0 && endpoints_[j]->health().state() == VendorHealth::HEALTHY) {
+			others.push_back(p95.count());
+		}
+	}
+	// Too few others to tell what normal looks like
+	if (others.size() < 2) {
+		return;
+	}
+	std::nth_element(others.begin(), others.begin() + others.size() / 2, others.end());
+	std::chrono::microseconds median(others[others.size() / 2]);
+	if (mine > median * policy_.outlier_factor && mine - median > policy_.outlier_margin) {
+		Eject(i, VendorHealth::HEALTHY, "p95 " + std::to_string(mine.count()) + "us against a median of " +
+			  std::to_string(median.count()) + "us");
+	}
+}
@@ -1,11 +1,13 @@
+#include <algorithm>
+#include <map>
 #include <memory>
-#include <stdlib.h> 
+#include <stdlib.h>
 
 #include <grpc++/grpc++.h>
 
 #include "store.grpc.pb.h"
 
-#include "product_queries_util.h"
+#include "store_client.h"
 
 using store::Store;
 using grpc::Channel;
@@ -15,48 +17,116 @@ using store::ProductQuery;
 using store::ProductReply;
 using store::ProductInfo;
 
-class StoreClient {
-
- public:
-  StoreClient(std::shared_ptr<Channel>);
-  bool getProducts(const ProductSpec&, ProductQueryResult&);
-
- private:
-  std::unique_ptr<Store::Stub> stub_;
+// One query in flight, used as its completion tag.
+struct StoreClient::PendingQuery {
+  ProductQuery query;
+  ProductReply reply;
+  ClientContext context;
+  Status status;
+  std::unique_ptr<grpc::ClientAsyncResponseReader<ProductReply> > reader;
+  Callback done;
 };
 
 
 bool run_client(const std::string& server_addr, const std::string& product_name, ProductQueryResult& pq_result) {
+  static std::mutex mutex;
+  static std::map<std::string, std::unique_ptr<StoreClient> > clients;
+  StoreClient* store_client;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::unique_ptr<StoreClient>& client = clients[server_addr];
+    if (!client) {
+      client.reset(new StoreClient(server_addr, StoreClient::Options()));
+    }
+    store_client = client.get();
+  }
+  return store_client->getProducts(product_name, pq_result);
+}
 
-  StoreClient store_client(grpc::CreateChannel(server_addr, grpc::InsecureChannelCredentials()));
-  return store_client.getProducts(product_name, pq_result);
+
+StoreClient::StoreClient(const std::string& server_addr, const Options& options)
+  : next_(0), options_(options), in_flight_(0) {
+  for (int i = 0; i < std::max(1, options_.channels); ++i) {
+    grpc::ChannelArguments args;
+    // Keep the channels on separate connections
+    args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+    stubs_.emplace_back(Store::NewStub(grpc::CreateCustomChannel(server_addr, grpc::InsecureChannelCredentials(), args)));
+  }
+  for (int i = 0; i < std::max(1, options_.completion_threads); ++i) {
+    threads_.emplace_back(&StoreClient::handle_completions, this);
+  }
 }
 
+StoreClient::~StoreClient() {
+  {
+    std::unique_lock<std::mutex> lock(drained_mutex_);
+    drained_.wait(lock, [this]() { return in_flight_ == 0; });
+  }
+  cq_.Shutdown();
+  for (auto& thread : threads_) {
+    thread.join();
+  }
+}
 
-StoreClient::StoreClient(std::shared_ptr<Channel> channel)
-  : stub_(Store::NewStub(channel)) 
-  {}
+void StoreClient::get_products(const ProductQuery& query, Callback done, std::chrono::milliseconds deadline) {
+  PendingQuery* pending = new PendingQuery();
+  pending->query.CopyFrom(query);
+  if (options_.compact) {
+    dictionary_.prepare(&pending->query);
+  }
+  pending->done = std::move(done);
+  if (deadline == std::chrono::milliseconds::zero()) {
+    deadline = options_.deadline;
+  }
+  pending->context.set_deadline(std::chrono::system_clock::now() + deadline);
+  ++in_flight_;
+  Store::Stub* stub = stubs_[next_.fetch_add(1, std::memory_order_relaxed) % stubs_.size()].get();
+  pending->reader = stub->PrepareAsyncgetProducts(&pending->context, pending->query, &cq_);
+  pending->reader->StartCall();
+  pending->reader->Finish(&pending->reply, &pending->status, pending);
+}
+
+std::future<StoreClient::Outcome> StoreClient::get_products(const ProductQuery& query,
+                                                            std::chrono::milliseconds deadline) {
+  std::shared_ptr<std::promise<Outcome> > promise = std::make_shared<std::promise<Outcome> >();
+  get_products(query, [promise](Outcome& outcome) { promise->set_value(std::move(outcome)); }, deadline);
+  return promise->get_future();
+}
 
 bool StoreClient::getProducts(const ProductSpec& product_spec, ProductQueryResult& query_result) {
   ProductQuery query;
   query.set_product_name(product_spec.name_);
+  Outcome outcome = get_products(query).get();
 
-  ProductReply reply;
-  ClientContext context;
-
-  Status status = stub_->getProducts(&context, query, &reply);
-
-  if (!status.ok()) {
-    std::cout << status.error_code() << ": " << status.error_message()
+  if (!outcome.status.ok()) {
+    std::cout << outcome.status.error_code() << ": " << outcome.status.error_message()
               << std::endl;
     return false;
   }
+  query_result.bids_.insert(query_result.bids_.end(), outcome.result.bids_.begin(), outcome.result.bids_.end());
+  return true;
+}
 
-  for (const auto result : reply.products()) {
-    ProductQueryResult::Bid bid;
-    bid.price_ = result.price();
-    bid.vendor_id_ = result.vendor_id();
-    query_result.bids_.push_back(bid);
+long StoreClient::in_flight() const {
+  return in_flight_;
+}
+
+void StoreClient::handle_completions() {
+  void* tag;
+  bool ok;
+  while (cq_.Next(&tag, &ok)) {
+    std::unique_ptr<PendingQuery> pending(static_cast<PendingQuery*>(tag));
+    Outcome outcome;
+    outcome.status = pending->status;
+    if (outcome.status.ok() &&
+        !expand_reply(pending->reply, pending->query.compact() ? &dictionary_ : nullptr, &outcome.result)) {
+      outcome.status = Status(grpc::StatusCode::DATA_LOSS, "compact reply from another store epoch");
+    }
+    pending->done(outcome);
+    pending.reset();
+    if (--in_flight_ == 0) {
+      std::lock_guard<std::mutex> lock(drained_mutex_);
+      drained_.notify_all();
+    }
   }
-  return true;
 }
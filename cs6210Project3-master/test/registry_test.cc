@@ -0,0 +1,96 @@
+// Checks that the limit on ejected vendors holds across a vendor list reload:
+// calls still out on the old snapshot report back through it, while new calls
+// go through the new one, and both must agree on how many vendors are out.
+//
+//   ./registry_test
+
+#include "vendor_registry.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+static int failures = 0;
+
+static void check(bool condition, const std::string& what) {
+  std::printf("%s: %s\n", condition ? "ok  " : "FAIL", what.c_str());
+  if (!condition) {
+    ++failures;
+  }
+}
+
+// Fails enough calls to vendor i to eject it, if the limit allows
+static void fail_calls(VendorRegistry& registry, size_t i, const HealthPolicy& policy) {
+  for (int call = 0; call < policy.min_calls; ++call) {
+    registry.Failed(i);
+  }
+}
+
+static bool is_healthy(VendorRegistry& registry, size_t i) {
+  return registry[i].health().state() == VendorHealth::HEALTHY;
+}
+
+int main() {
+  HealthPolicy policy;
+  policy.max_error_pct = 50;
+  policy.eject_time = std::chrono::milliseconds(1);
+  policy.max_ejected_pct = 50;
+  // The vendors are never dialled: nothing here makes a call
+  std::vector<std::string> addresses;
+  addresses.push_back("localhost:50601");
+  addresses.push_back("localhost:50602");
+  addresses.push_back("localhost:50603");
+  addresses.push_back("localhost:50604");
+
+  VendorRegistry before(addresses, 1, policy);
+  fail_calls(before, 0, policy);
+  fail_calls(before, 1, policy);
+  fail_calls(before, 2, policy);
+  check(before.ejected() == 2, "two of four vendors ejected before the reload");
+  check(is_healthy(before, 2), "the third is held back by the limit");
+
+  // The same vendors, in another order, plus one more: the limit becomes 2 of 5
+  std::vector<std::string> reloaded;
+  reloaded.push_back(addresses[3]);
+  reloaded.push_back(addresses[2]);
+  reloaded.push_back(addresses[1]);
+  reloaded.push_back(addresses[0]);
+  reloaded.push_back("localhost:50605");
+  VendorRegistry after(reloaded, 1, policy, &before);
+  check(after.ejected() == 2, "the reload carries both ejections over");
+
+  // The first vendor recovers through the new snapshot
+  std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  check(after.Allow(3), "the first vendor is probed once its ejection ran out");
+  after.Succeeded(3);
+  check(is_healthy(after, 3), "the probe restores it");
+  check(before.ejected() == 1 && after.ejected() == 1, "both snapshots see the restore");
+
+  // A call still out on the old snapshot ejects the third vendor, now that
+  // there is room
+  fail_calls(before, 2, policy);
+  check(!is_healthy(before, 2), "the old snapshot ejects the third vendor");
+  check(after.ejected() == 2, "the new snapshot sees that ejection");
+
+  // The limit is reached in both
+  fail_calls(after, 0, policy);
+  check(is_healthy(after, 0), "the new snapshot holds the fourth vendor back");
+  fail_calls(before, 3, policy);
+  check(is_healthy(before, 3), "the old snapshot holds the fourth vendor back");
+
+  // The second vendor recovers through the old snapshot, which frees a place
+  // in the new one
+  std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  check(before.Allow(1), "the second vendor is probed through the old snapshot");
+  before.Succeeded(1);
+  check(after.ejected() == 1, "the new snapshot sees that restore");
+  fail_calls(after, 0, policy);
+  check(!is_healthy(after, 0), "the new snapshot can eject the fourth vendor");
+  check(after.ejected() == 2, "and stays at its limit");
+
+  std::printf(failures ? "%d checks failed\n" : "all checks passed\n", failures);
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "store.pb.h"
+#include "product_queries_util.h"
+
+// The client's copy of the store's vendor dictionary, for compact replies.
+// Each query says how much of the dictionary it holds, and each reply brings
+// the entries added since. Shared by every query to the same store.
+class ReplyDictionary {
+ public:
+  // Asks for a compact reply, saying which entries we already hold
+  void prepare(store::ProductQuery* query) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    query->set_compact(true);
+    query->set_dictionary_epoch(epoch_);
+    query->set_dictionary_size(ids_.size());
+  }
+
+  // Adds the reply's bids to "result", naming each vendor from the
+  // dictionary. Returns false if the reply cannot be decoded, which can only
+  // happen if the store restarted while it was in flight.
+  bool expand(const store::ProductReply& reply, ProductQueryResult* result) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (reply.dictionary_epoch() != epoch_) {
+      if (reply.dictionary_offset() != 0) {
+        return false;
+      }
+      epoch_ = reply.dictionary_epoch();
+      ids_.clear();
+    }
+    // Replies can land out of order, so some entries may already be here
+    if (reply.dictionary_offset() > ids_.size()) {
+      return false;
+    }
+    for (size_t i = ids_.size() - reply.dictionary_offset(); i < size_t(reply.vendor_ids_size()); ++i) {
+      ids_.push_back(reply.vendor_ids(i));
+    }
+    if (reply.prices_size() != reply.vendor_indices_size()) {
+      return false;
+    }
+    for (int i = 0; i < reply.prices_size(); ++i) {
+      if (reply.vendor_indices(i) >= ids_.size()) {
+        return false;
+      }
+      ProductQueryResult::Bid bid;
+      bid.price_ = reply.prices(i);
+      bid.vendor_id_ = ids_[reply.vendor_indices(i)];
+      result->bids_.push_back(bid);
+    }
+    return true;
+  }
+
+ private:
+  std::mutex mutex_;
+  uint64_t epoch_ = 0;
+  std::vector<std::string> ids_;
+};
+
+// Adds a reply's bids to "result": a compact reply's through "dictionary",
+// and a plain reply's as they are when "dictionary" is null. Returns false if
+// a compact reply cannot be decoded.
+inline bool expand_reply(const store::ProductReply& reply, ReplyDictionary* dictionary, ProductQueryResult* result) {
+  if (dictionary) {
+    return dictionary->expand(reply, result);
+  }
+  for (const auto& product : reply.products()) {
+    ProductQueryResult::Bid bid;
+    bid.price_ = product.price();
+    bid.vendor_id_ = product.vendor_id();
+    result->bids_.push_back(bid);
+  }
+  return true;
+}
@@ -1,98 +1,660 @@
 #include "product_queries_util.h"
+#include "histogram.h"
+#include "reply_dictionary.h"
+#include "store_client.h"
 
-#include <thread>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <thread>
+
+#include <grpc++/grpc++.h>
+
+#include "store.grpc.pb.h"
+
+// An open-loop load generator for the store. Queries are sent on a schedule
+// (constant or Poisson arrivals at a target QPS) whether or not earlier ones
+// have come back, so queueing in the store shows up as latency instead of
+// silently slowing the generator down. Latency is measured from when a query
+// was due to be sent, not from when it actually went out.
+//
+// Without --qps it queries every product in the list once and prints the
+// bids, as the original test driver did. --batch and --stream check
+// getProductsBatch and getProductsStream against getProducts instead, and
+// --burst sends queries back to back from one thread through StoreClient.
+
+typedef std::chrono::steady_clock clock_type;
+
+struct LoadOptions {
+  // Queries per second to send; 0 queries each product once and prints the bids
+  double qps = 0;
+  // Exponential gaps between queries rather than equal ones
+  bool poisson = true;
+  // Seconds of load before and during measurement
+  double warmup_s = 2;
+  double measure_s = 10;
+  // Zipf exponent of the product mix; 0 picks products uniformly
+  double zipf_s = 0;
+  // Channels the queries are spread across
+  int channels = 4;
+  int deadline_ms = 5000;
+  std::string products = "product_query_list.txt";
+  std::string csv = "load_results.csv";
+  // Print the store's own per-stage latencies after the run
+  bool store_stats = false;
+  // Passed on in every ProductQuery; 0 leaves them unset
+  int top_k = 0;
+  double max_price = 0;
+  int min_responses = 0;
+  // Ask for compact replies, naming vendors by index into a dictionary
+  bool compact = false;
+  // Check getProductsBatch with batches of this many products; 0 does not
+  int batch = 0;
+  // Check getProductsStream
+  bool stream = false;
+  // Send this many queries back to back through one StoreClient; 0 does not
+  int burst = 0;
+};
+
+// One query in flight, used as its completion tag.
+struct AsyncQuery {
+  store::ProductReply reply;
+  grpc::ClientContext context;
+  grpc::Status status;
+  std::unique_ptr<grpc::ClientAsyncResponseReader<store::ProductReply> > reader;
+  // When the schedule said it should be sent
+  clock_type::time_point due;
+  bool measured;
+  // Index into the product list in listing mode, otherwise -1
+  int query_id;
+};
+
+// What one completion thread saw
+struct CompletionStats {
+  LatencyHistogram latency_us;
+  uint64_t errors = 0;
+  // Encoded size of the replies, as they went over the wire
+  uint64_t reply_bytes = 0;
+};
+
+bool parse_options(int argc, char** argv, LoadOptions& options, std::vector<std::string>& positional);
+
+void handle_completions(grpc::CompletionQueue* cq, CompletionStats* stats, std::vector<ProductQueryResult>* results,
+                        ReplyDictionary* dictionary, std::atomic<long>* outstanding);
+
+bool run_load(const std::vector<ProductSpec>& product_specs, const LoadOptions& options,
+              int num_cq_threads, const std::string& server_addr);
 
-extern bool run_client(const std::string& server_addr, const std::string& product_name, ProductQueryResult&);
+bool run_batch_check(const std::vector<ProductSpec>& product_specs, const LoadOptions& options,
+                     const std::string& server_addr);
 
-bool run_test(std::vector<ProductSpec>& product_specs, const int num_max_threads, const std::string& server_addr);
+bool run_stream_check(const std::vector<ProductSpec>& product_specs, const LoadOptions& options,
+                      const std::string& server_addr);
 
-void thread_task(std::string server_addr, ProductSpec& p_spec, ProductQueryResult& pq_result,  int query_id, bool& is_done);
+bool run_burst(const std::vector<ProductSpec>& product_specs, const LoadOptions& options,
+               int num_cq_threads, const std::string& server_addr);
 
 int main(int argc, char** argv) {
-  
-  int num_max_threads;
+  LoadOptions options;
+  std::vector<std::string> positional;
+  if (!parse_options(argc, argv, options, positional)) {
+    return EXIT_FAILURE;
+  }
+
+  int num_cq_threads;
   std::string server_addr;
-  if (argc == 3) {
-    server_addr = std::string(argv[1]);
-    num_max_threads = std::min( 20, std::max(0,atoi(argv[2])));
+  if (positional.size() >= 2) {
+    server_addr = positional[0];
+    num_cq_threads = std::max(1, atoi(positional[1].c_str()));
   }
-  else if (argc == 2) {
-    server_addr = std::string(argv[1]);
-    num_max_threads = 4;
+  else if (positional.size() == 1) {
+    server_addr = positional[0];
+    num_cq_threads = 4;
   }
   else {
     server_addr = "0.0.0.0:50053";
-    num_max_threads = 4;
+    num_cq_threads = 4;
   }
 
   std::vector<ProductSpec> product_specs;
-  const std::string filename = "product_query_list.txt";
-  if (!read_product_queries(product_specs, filename)) {
-  	std::cerr << "Failed to extract product queries from: " << filename << std::endl;
-  	return EXIT_FAILURE;
+  if (!read_product_queries(product_specs, options.products) || product_specs.empty()) {
+    std::cerr << "Failed to extract product queries from: " << options.products << std::endl;
+    return EXIT_FAILURE;
   }
 
-  return run_test(product_specs, num_max_threads, server_addr) 
+  if (options.batch > 0) {
+    return run_batch_check(product_specs, options, server_addr) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  if (options.stream) {
+    return run_stream_check(product_specs, options, server_addr) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  if (options.burst > 0) {
+    return run_burst(product_specs, options, num_cq_threads, server_addr) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  return run_load(product_specs, options, num_cq_threads, server_addr)
       ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
+bool parse_options(int argc, char** argv, LoadOptions& options, std::vector<std::string>& positional) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg.compare(0, 2, "--") != 0) {
+      positional.push_back(arg);
+      continue;
+    }
+    size_t eq = arg.find('=');
+    std::string name = arg.substr(2, eq == std::string::npos ? std::string::npos : eq - 2);
+    std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+    if (name == "qps") {
+      options.qps = std::max(0.0, atof(value.c_str()));
+    } else if (name == "arrivals" && (value == "poisson" || value == "constant")) {
+      options.poisson = value == "poisson";
+    } else if (name == "warmup_s") {
+      options.warmup_s = std::max(0.0, atof(value.c_str()));
+    } else if (name == "measure_s") {
+      options.measure_s = std::max(0.1, atof(value.c_str()));
+    } else if (name == "zipf") {
+      options.zipf_s = std::max(0.0, atof(value.c_str()));
+    } else if (name == "channels") {
+      options.channels = std::max(1, atoi(value.c_str()));
+    } else if (name == "deadline_ms") {
+      options.deadline_ms = std::max(1, atoi(value.c_str()));
+    } else if (name == "products" && !value.empty()) {
+      options.products = value;
+    } else if (name == "store_stats") {
+      options.store_stats = value.empty() || value == "true";
+    } else if (name == "top_k") {
+      options.top_k = std::max(0, atoi(value.c_str()));
+    } else if (name == "max_price") {
+      options.max_price = std::max(0.0, atof(value.c_str()));
+    } else if (name == "min_responses") {
+      options.min_responses = std::max(0, atoi(value.c_str()));
+    } else if (name == "compact") {
+      options.compact = value.empty() || value == "true";
+    } else if (name == "stream") {
+      options.stream = value.empty() || value == "true";
+    } else if (name == "batch") {
+      options.batch = std::max(1, atoi(value.c_str()));
+    } else if (name == "burst") {
+      options.burst = std::max(1, atoi(value.c_str()));
+    } else if (name == "csv" && !value.empty()) {
+      options.csv = value;
+    } else {
+      std::cerr << "Invalid option " << arg << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
 
-bool warm_up(bool & is_done){
-  is_done = true;
+void handle_completions(grpc::CompletionQueue* cq, CompletionStats* stats, std::vector<ProductQueryResult>* results,
+                        ReplyDictionary* dictionary, std::atomic<long>* outstanding) {
+  void* tag;
+  bool ok;
+  while (cq->Next(&tag, &ok)) {
+    AsyncQuery* query = static_cast<AsyncQuery*>(tag);
+    bool answered = ok && query->status.ok();
+    ProductQueryResult scratch;
+    ProductQueryResult* result = query->query_id >= 0 ? &(*results)[query->query_id] : &scratch;
+    // Compact replies are always decoded, so the dictionary keeps up with the
+    // store; plain ones only when the bids are printed
+    if (answered && (dictionary || query->query_id >= 0)) {
+      answered = expand_reply(query->reply, dictionary, result);
+    }
+    if (query->measured) {
+      if (answered) {
+        stats->latency_us.Record(std::chrono::duration_cast<std::chrono::microseconds>(
+            clock_type::now() - query->due).count());
+        stats->reply_bytes += query->reply.ByteSizeLong();
+      } else {
+        ++stats->errors;
+      }
+    }
+    if (query->query_id >= 0) {
+      if (!answered) {
+        std::cout << "\nStore failed to receive reply for query id: " << query->query_id
+                  << ", " << query->status.error_code() << ": " << query->status.error_message() << std::endl;
+      }
+    }
+    delete query;
+    --(*outstanding);
+  }
+}
+
+// Picks product indices, either uniformly or by Zipf rank in list order.
+class ProductMix {
+ public:
+  ProductMix(size_t num_products, double zipf_s) {
+    std::vector<double> weights(num_products, 1.0);
+    if (zipf_s > 0) {
+      for (size_t i = 0; i < num_products; ++i) {
+        weights[i] = 1.0 / std::pow(double(i + 1), zipf_s);
+      }
+    }
+    pick_ = std::discrete_distribution<size_t>(weights.begin(), weights.end());
+  }
+
+  size_t next(std::mt19937_64& rng) { return pick_(rng); }
+
+ private:
+  std::discrete_distribution<size_t> pick_;
+};
+
+void write_csv(const LoadOptions& options, const std::string& server_addr, uint64_t sent,
+               const LatencyHistogram& latency, uint64_t errors, double seconds) {
+  bool is_new = !std::ifstream(options.csv).good();
+  std::ofstream csv(options.csv, std::ios::app);
+  if (!csv.is_open()) {
+    std::cerr << "Failed to open file " << options.csv << std::endl;
+    return;
+  }
+  if (is_new) {
+    csv << "server,target_qps,arrivals,zipf,measure_s,sent,completed,errors,throughput_qps,"
+        << "mean_us,p50_us,p90_us,p99_us,p999_us,max_us\n";
+  }
+  csv << server_addr << "," << options.qps << "," << (options.poisson ? "poisson" : "constant") << ","
+      << options.zipf_s << "," << seconds << "," << sent << "," << latency.Count() << "," << errors << ","
+      << latency.Count() / seconds << "," << latency.Mean() << "," << latency.Percentile(50) << ","
+      << latency.Percentile(90) << "," << latency.Percentile(99) << "," << latency.Percentile(99.9) << ","
+      << latency.Max() << "\n";
 }
 
-bool run_test(std::vector<ProductSpec>& product_specs, const int num_max_threads, const std::string& server_addr) {
-  bool threads_is_done[num_max_threads];
-  std::fill_n(threads_is_done, num_max_threads, false);
-  std::vector<std::thread*> threads(num_max_threads, NULL);
+// Fetches the store's stats, starting them afresh if "reset"
+bool get_store_stats(store::Store::Stub* stub, bool reset, store::StatsReply* reply) {
+  store::StatsQuery query;
+  query.set_reset(reset);
+  grpc::ClientContext context;
+  context.set_deadline(std::chrono::system_clock::now() + std::chrono::seconds(5));
+  grpc::Status status = stub->getStats(&context, query, reply);
+  if (!status.ok()) {
+    std::cout << "getStats failed: " << status.error_code() << ": " << status.error_message() << std::endl;
+  }
+  return status.ok();
+}
 
-  for (int i = 0; i < num_max_threads; ++i) {
-    threads[i] = new std::thread(warm_up, std::ref(threads_is_done[i]));
+void print_summary(const store::LatencySummary& summary) {
+  std::cout << "  " << summary.name() << ": n " << summary.count() << ", mean " << summary.mean_us()
+            << ", p50 " << summary.p50_us() << ", p90 " << summary.p90_us() << ", p99 " << summary.p99_us()
+            << ", p99.9 " << summary.p999_us() << ", max " << summary.max_us() << std::endl;
+}
+
+bool run_load(const std::vector<ProductSpec>& product_specs, const LoadOptions& options,
+              int num_cq_threads, const std::string& server_addr) {
+  std::vector<std::unique_ptr<store::Store::Stub> > stubs;
+  for (int i = 0; i < options.channels; ++i) {
+    grpc::ChannelArguments args;
+    // Keep the channels on separate connections
+    args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+    stubs.emplace_back(store::Store::NewStub(
+        grpc::CreateCustomChannel(server_addr, grpc::InsecureChannelCredentials(), args)));
   }
-  
-  std::vector<ProductQueryResult> test_results(product_specs.size());
 
-  size_t thread_ind = 0;
-  for (int i = 0; i < product_specs.size(); ++i) {
-    while (!threads_is_done[thread_ind]) {
-      thread_ind = (thread_ind + 1) % num_max_threads;
+  std::vector<std::unique_ptr<grpc::CompletionQueue> > cqs;
+  std::vector<CompletionStats> stats(num_cq_threads);
+  std::vector<ProductQueryResult> results(product_specs.size());
+  std::atomic<long> outstanding(0);
+  ReplyDictionary dictionary;
+  ReplyDictionary* compact = options.compact ? &dictionary : nullptr;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num_cq_threads; ++i) {
+    cqs.emplace_back(new grpc::CompletionQueue());
+    threads.emplace_back(handle_completions, cqs.back().get(), &stats[i], &results, compact, &outstanding);
+  }
+
+  bool listing = options.qps == 0;
+  store::StatsReply store_stats;
+  if (!listing && options.store_stats) {
+    get_store_stats(stubs[0].get(), true, &store_stats);
+  }
+  uint64_t issued = 0;
+  uint64_t sent_measured = 0;
+  auto send = [&](size_t product, clock_type::time_point due, bool measured, int query_id) {
+    AsyncQuery* query = new AsyncQuery();
+    query->due = due;
+    query->measured = measured;
+    query->query_id = query_id;
+    query->context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(options.deadline_ms));
+    store::ProductQuery request;
+    request.set_product_name(product_specs[product].name_);
+    request.set_top_k(options.top_k);
+    request.set_max_price(options.max_price);
+    request.set_min_responses(options.min_responses);
+    if (compact) {
+      compact->prepare(&request);
     }
-    
-    threads[thread_ind]->join();
-    delete threads[thread_ind];
-    
-    threads[thread_ind] = new std::thread(thread_task, 
-          server_addr, std::ref(product_specs[i]), std::ref(test_results[i]), i, std::ref(threads_is_done[i]));
-    
-    thread_ind = (thread_ind + 1) % num_max_threads;
+    ++outstanding;
+    query->reader = stubs[issued % stubs.size()]->PrepareAsyncgetProducts(
+        &query->context, request, cqs[issued % cqs.size()].get());
+    query->reader->StartCall();
+    query->reader->Finish(&query->reply, &query->status, query);
+    ++issued;
+    if (measured) {
+      ++sent_measured;
+    }
+  };
+
+  clock_type::time_point measure_start;
+  clock_type::time_point measure_end;
+  if (listing) {
+    measure_start = clock_type::now();
+    for (size_t i = 0; i < product_specs.size(); ++i) {
+      send(i, clock_type::now(), true, i);
+    }
+  } else {
+    std::mt19937_64 rng(std::random_device{}());
+    std::exponential_distribution<double> poisson_gap(options.qps);
+    ProductMix mix(product_specs.size(), options.zipf_s);
+
+    clock_type::time_point start = clock_type::now();
+    measure_start = start + std::chrono::duration_cast<clock_type::duration>(
+        std::chrono::duration<double>(options.warmup_s));
+    measure_end = measure_start + std::chrono::duration_cast<clock_type::duration>(
+        std::chrono::duration<double>(options.measure_s));
+    std::cout << "Sending " << options.qps << " queries/s (" << (options.poisson ? "poisson" : "constant")
+              << ") to " << server_addr << ": " << options.warmup_s << "s warmup, "
+              << options.measure_s << "s measured" << std::endl;
+
+    // Send times follow the schedule alone. If we fall behind, the queries that
+    // are due go out at once and their lateness counts against them.
+    clock_type::time_point due = start;
+    while (due < measure_end) {
+      std::this_thread::sleep_until(due);
+      send(mix.next(rng), due, due >= measure_start, -1);
+      double gap = options.poisson ? poisson_gap(rng) : 1.0 / options.qps;
+      due += std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(gap));
+    }
+  }
+
+  // Every query ends by its deadline, so this wait is bounded
+  while (outstanding > 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  if (listing) {
+    measure_end = clock_type::now();
+  }
+  for (int i = 0; i < num_cq_threads; ++i) {
+    cqs[i]->Shutdown();
+  }
+  for (auto& thread : threads) {
+    thread.join();
   }
 
-  for (int i = 0; i < num_max_threads; ++i) {
-    threads[i]->join();
+  LatencyHistogram latency;
+  uint64_t errors = 0;
+  uint64_t reply_bytes = 0;
+  for (const auto& s : stats) {
+    latency.Merge(s.latency_us);
+    errors += s.errors;
+    reply_bytes += s.reply_bytes;
   }
+  double seconds = std::chrono::duration<double>(measure_end - measure_start).count();
 
-  for (int i = 0; i < test_results.size(); ++i) {
-    const auto bids = test_results[i].bids_;
-    if (bids.size()) {
-      std::cout << "\n\nQuery id: " << i << ", product: " << product_specs[i].name_ << " is -->  ";
-      for (const auto bid : bids) {
-        std::cout << "(price: " << bid.price_ << ", vendor_id: " << bid.vendor_id_ << ") ";
+  if (listing) {
+    for (size_t i = 0; i < results.size(); ++i) {
+      const auto& bids = results[i].bids_;
+      if (bids.size()) {
+        std::cout << "\n\nQuery id: " << i << ", product: " << product_specs[i].name_ << " is -->  ";
+        for (const auto& bid : bids) {
+          std::cout << "(price: " << bid.price_ << ", vendor_id: " << bid.vendor_id_ << ") ";
+        }
       }
+      else {
+        std::cout << "\n\nQuery id: " << i << ", product: " << product_specs[i].name_ << " -->  Didn't receive any bids";
+      }
+    }
+    std::cout << std::endl;
+    return errors == 0;
+  }
+
+  std::cout << "sent " << sent_measured << ", completed " << latency.Count() << ", errors " << errors
+            << ", throughput " << latency.Count() / seconds << " queries/s" << std::endl;
+  std::cout << "latency us: p50 " << latency.Percentile(50) << ", p90 " << latency.Percentile(90)
+            << ", p99 " << latency.Percentile(99) << ", p99.9 " << latency.Percentile(99.9)
+            << ", max " << latency.Max() << std::endl;
+  if (latency.Count() > 0) {
+    std::cout << "reply bytes: mean " << reply_bytes / latency.Count() << std::endl;
+  }
+  write_csv(options, server_addr, sent_measured, latency, errors, seconds);
+
+  // Includes the warmup
+  if (options.store_stats && get_store_stats(stubs[0].get(), false, &store_stats)) {
+    std::cout << "store stages (us):" << std::endl;
+    for (const auto& stage : store_stats.stages()) {
+      print_summary(stage);
     }
-    else {
-      std::cout << "\n\nQuery id: " << i << ", product: " << product_specs[i].name_ << " -->  Didn't receive any bids";
+    std::cout << "vendor round trips (us):" << std::endl;
+    for (const auto& vendor : store_stats.vendors()) {
+      print_summary(vendor);
+    }
+    std::cout << "pool: " << store_stats.pool_threads() << " threads, " << store_stats.pool_queue_depth()
+              << " queued, " << store_stats.pool_bulk_queue_depth() << " bulk queued" << std::endl;
+    std::cout << "rejected: " << store_stats.rejected() << std::endl;
+    for (const auto& address : store_stats.ejected_vendors()) {
+      std::cout << "ejected: " << address << std::endl;
     }
   }
-  std::cout << std::endl;
-  
   return true;
 }
 
-void thread_task(const std::string server_addr, ProductSpec& p_spec, ProductQueryResult& pq_result, int query_id, bool& is_done) {
+// A reply's bids as "vendor_id price", sorted, so that two replies for the
+// same product can be compared whatever order the vendors answered in
+std::vector<std::string> bid_set(const google::protobuf::RepeatedPtrField<store::ProductInfo>& products) {
+  std::vector<std::string> bids;
+  for (const auto& product : products) {
+    bids.push_back(product.vendor_id() + " " + std::to_string(product.price()));
+  }
+  std::sort(bids.begin(), bids.end());
+  return bids;
+}
+
+// What getProducts says for "product", to check the other RPCs against.
+// False if it failed.
+bool reference_reply(store::Store::Stub* stub, const std::string& product, const LoadOptions& options,
+                     store::ProductReply* reply) {
+  store::ProductQuery query;
+  query.set_product_name(product);
+  grpc::ClientContext context;
+  context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(options.deadline_ms));
+  grpc::Status status = stub->getProducts(&context, query, reply);
+  if (!status.ok()) {
+    std::cout << "getProducts " << product << " failed: " << status.error_code() << ": "
+              << status.error_message() << std::endl;
+  }
+  return status.ok();
+}
+
+// Sends the product list to getProductsBatch, options.batch products at a
+// time, and checks that every batch comes back within its deadline with one
+// reply per product, in the order asked. Each product's bids must match what
+// getProducts returns for it alone; products where either call is missing a
+// vendor are only counted.
+bool run_batch_check(const std::vector<ProductSpec>& product_specs, const LoadOptions& options,
+                     const std::string& server_addr) {
+  std::unique_ptr<store::Store::Stub> stub(
+      store::Store::NewStub(grpc::CreateChannel(server_addr, grpc::InsecureChannelCredentials())));
+  uint64_t batches = 0;
+  uint64_t errors = 0;
+  uint64_t mismatched = 0;
+  uint64_t incomplete = 0;
+  LatencyHistogram latency_us;
+  for (size_t first = 0; first < product_specs.size(); first += options.batch) {
+    size_t last = std::min(product_specs.size(), first + options.batch);
+    store::ProductBatchQuery query;
+    for (size_t i = first; i < last; ++i) {
+      query.add_product_names(product_specs[i].name_);
+    }
+    store::ProductBatchReply reply;
+    grpc::ClientContext context;
+    context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(options.deadline_ms));
+    clock_type::time_point start = clock_type::now();
+    grpc::Status status = stub->getProductsBatch(&context, query, &reply);
+    uint64_t elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(clock_type::now() - start).count();
+    ++batches;
+    if (!status.ok()) {
+      std::cout << "batch " << first << "-" << last - 1 << " failed: " << status.error_code() << ": "
+                << status.error_message() << std::endl;
+      ++errors;
+      continue;
+    }
+    latency_us.Record(elapsed_us);
+    if (elapsed_us > uint64_t(options.deadline_ms) * 1000) {
+      std::cout << "batch " << first << "-" << last - 1 << " answered after its deadline, in " << elapsed_us
+                << "us" << std::endl;
+      ++errors;
+    }
+    if (reply.replies_size() != int(last - first)) {
+      std::cout << "batch " << first << "-" << last - 1 << " has " << reply.replies_size() << " replies for "
+                << last - first << " products" << std::endl;
+      ++errors;
+      continue;
+    }
+    for (size_t i = first; i < last; ++i) {
+      const store::ProductReply& batched = reply.replies(i - first);
+      store::ProductReply single;
+      if (!reference_reply(stub.get(), product_specs[i].name_, options, &single)) {
+        ++errors;
+      } else if (batched.missing_vendors_size() > 0 || single.missing_vendors_size() > 0) {
+        ++incomplete;
+      } else if (bid_set(batched.products()) != bid_set(single.products())) {
+        std::cout << "product " << i << " (" << product_specs[i].name_ << "): batch reply has "
+                  << batched.products_size() << " bids, getProducts " << single.products_size()
+                  << ", or their prices differ" << std::endl;
+        ++mismatched;
+      }
+    }
+  }
+  std::cout << "batch check: " << batches << " batches of up to " << options.batch << " products, " << errors
+            << " errors, " << mismatched << " products mismatched, " << incomplete
+            << " with missing vendors" << std::endl;
+  std::cout << "batch latency us: p50 " << latency_us.Percentile(50) << ", p99 " << latency_us.Percentile(99)
+            << ", max " << latency_us.Max() << std::endl;
+  return errors == 0 && mismatched == 0;
+}
 
-  if (!run_client(server_addr, p_spec.name_, pq_result)) {
-    std::cout << "\nStore failed to receive reply for: " << p_spec.name_ << ", query id: " << query_id <<  std::endl;
+// Streams every product in the list with getProductsStream and checks that
+// each stream ends OK within its deadline, with one message per vendor: no
+// vendor twice, and the same bids as getProducts when no vendor is missing
+// from that. Reports when the first and the last bid of a stream arrived.
+bool run_stream_check(const std::vector<ProductSpec>& product_specs, const LoadOptions& options,
+                      const std::string& server_addr) {
+  std::unique_ptr<store::Store::Stub> stub(
+      store::Store::NewStub(grpc::CreateChannel(server_addr, grpc::InsecureChannelCredentials())));
+  uint64_t errors = 0;
+  uint64_t mismatched = 0;
+  uint64_t incomplete = 0;
+  LatencyHistogram first_us;
+  LatencyHistogram last_us;
+  for (size_t i = 0; i < product_specs.size(); ++i) {
+    const std::string& product = product_specs[i].name_;
+    store::ProductQuery query;
+    query.set_product_name(product);
+    grpc::ClientContext context;
+    context.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(options.deadline_ms));
+    clock_type::time_point start = clock_type::now();
+    std::unique_ptr<grpc::ClientReader<store::ProductInfo> > reader(stub->getProductsStream(&context, query));
+    google::protobuf::RepeatedPtrField<store::ProductInfo> streamed;
+    store::ProductInfo bid;
+    uint64_t last = 0;
+    while (reader->Read(&bid)) {
+      last = std::chrono::duration_cast<std::chrono::microseconds>(clock_type::now() - start).count();
+      if (streamed.empty()) {
+        first_us.Record(last);
+      }
+      *streamed.Add() = bid;
+    }
+    grpc::Status status = reader->Finish();
+    uint64_t elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(clock_type::now() - start).count();
+    if (!status.ok()) {
+      std::cout << "stream " << i << " (" << product << ") failed: " << status.error_code() << ": "
+                << status.error_message() << std::endl;
+      ++errors;
+      continue;
+    }
+    if (!streamed.empty()) {
+      last_us.Record(last);
+    }
+    if (elapsed_us > uint64_t(options.deadline_ms) * 1000) {
+      std::cout << "stream " << i << " (" << product << ") ended after its deadline, in " << elapsed_us << "us"
+                << std::endl;
+      ++errors;
+    }
+    std::vector<std::string> vendors;
+    for (const auto& info : streamed) {
+      vendors.push_back(info.vendor_id());
+    }
+    std::sort(vendors.begin(), vendors.end());
+    if (std::adjacent_find(vendors.begin(), vendors.end()) != vendors.end()) {
+      std::cout << "stream " << i << " (" << product << ") sent a vendor's bid twice" << std::endl;
+      ++mismatched;
+      continue;
+    }
+    store::ProductReply single;
+    if (!reference_reply(stub.get(), product, options, &single)) {
+      ++errors;
+    } else if (single.missing_vendors_size() > 0) {
+      ++incomplete;
+    } else if (bid_set(streamed) != bid_set(single.products())) {
+      std::cout << "stream " << i << " (" << product << ") sent " << streamed.size() << " bids, getProducts "
+                << single.products_size() << ", or their prices differ" << std::endl;
+      ++mismatched;
+    }
   }
+  std::cout << "stream check: " << product_specs.size() << " streams, " << errors << " errors, " << mismatched
+            << " mismatched, " << incomplete << " with missing vendors" << std::endl;
+  std::cout << "first bid us: p50 " << first_us.Percentile(50) << ", p99 " << first_us.Percentile(99)
+            << "; last bid us: p50 " << last_us.Percentile(50) << ", p99 " << last_us.Percentile(99) << std::endl;
+  return errors == 0 && mismatched == 0;
 }
 
+// Sends options.burst queries, cycling through the product list, from this
+// one thread without waiting for any of them, through a StoreClient as a
+// service embedding the store would. Reports how many were in flight at most
+// and how long it took until every one was answered.
+bool run_burst(const std::vector<ProductSpec>& product_specs, const LoadOptions& options,
+               int num_cq_threads, const std::string& server_addr) {
+  StoreClient::Options client_options;
+  client_options.channels = options.channels;
+  client_options.completion_threads = num_cq_threads;
+  client_options.deadline = std::chrono::milliseconds(options.deadline_ms);
+  client_options.compact = options.compact;
+  std::atomic<long> completed(0);
+  std::atomic<long> errors(0);
+  std::atomic<long> no_bids(0);
+  long peak = 0;
+  clock_type::time_point start = clock_type::now();
+  clock_type::time_point end;
+  {
+    StoreClient client(server_addr, client_options);
+    for (int i = 0; i < options.burst; ++i) {
+      store::ProductQuery query;
+      query.set_product_name(product_specs[i % product_specs.size()].name_);
+      query.set_top_k(options.top_k);
+      query.set_max_price(options.max_price);
+      query.set_min_responses(options.min_responses);
+      client.get_products(query, [&](StoreClient::Outcome& outcome) {
+        if (!outcome.status.ok()) {
+          ++errors;
+        } else if (outcome.result.bids_.empty()) {
+          ++no_bids;
+        }
+        ++completed;
+      });
+      peak = std::max(peak, client.in_flight());
+    }
+    // Every query ends by its deadline, so this wait is bounded
+    while (completed < options.burst) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    end = clock_type::now();
+  }
+  std::cout << "burst: " << options.burst << " queries from one thread over " << options.channels
+            << " channels, at most " << peak << " in flight, all answered in "
+            << std::chrono::duration<double>(end - start).count() << "s, " << errors << " errors, " << no_bids
+            << " without bids" << std::endl;
+  return errors == 0;
+}
@@ -1,16 +1,39 @@
 #include <string>
 #include <iostream>
 #include <fstream>
-#include <thread>
 #include <vector>
 #include <memory>
+#include <algorithm>
+#include <cstdlib>
+#include <sys/resource.h>
 
-extern void run_server(const std::string);
+#include "vendor_profile.h"
 
-void run_vendors(const std::vector<std::string>& ip_addrresses);
+extern void run_vendor_host(const std::vector<std::string>& addresses, const VendorProfiles& profiles, int num_cqs);
+
+void raise_file_limit();
 
 int main(int argc, char** argv) {
 
+  // --profiles=FILE gives the vendors latencies, errors and throughput limits;
+  // --cqs=N is how many completion queue threads serve them all
+  VendorProfiles profiles;
+  int num_cqs = 2;
+  int kept = 1;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg.compare(0, 11, "--profiles=") == 0) {
+      if (!profiles.load(arg.substr(11))) {
+        return EXIT_FAILURE;
+      }
+    } else if (arg.compare(0, 6, "--cqs=") == 0) {
+      num_cqs = std::max(1, atoi(arg.substr(6).c_str()));
+    } else {
+      argv[kept++] = argv[i];
+    }
+  }
+  argc = kept;
+
   int addr_index = -1;
   std::string filename;
   if (argc == 3) {
@@ -21,7 +44,7 @@ int main(int argc, char** argv) {
     filename = std::string(argv[1]);
   }
   else {
-    std::cerr << "Correct usage: ./run_vendors $file_path_for_server_addrress [$index]" << std::endl;
+    std::cerr << "Correct usage: ./run_vendors $file_path_for_server_addrress [$index] [--profiles=FILE] [--cqs=N]" << std::endl;
     return EXIT_FAILURE;
   }
 
@@ -50,22 +73,16 @@ int main(int argc, char** argv) {
     return EXIT_FAILURE;
   }
 
-  run_vendors(ip_addrresses);
+  // Every vendor is a listening socket plus the store's connections to it
+  raise_file_limit();
+  run_vendor_host(ip_addrresses, profiles, num_cqs);
   return EXIT_SUCCESS;
 }
 
-
-void run_vendors(const std::vector<std::string>& ip_addrresses) {
-
-  typedef std::unique_ptr<std::thread> ThreadPtr;
-  ThreadPtr threads[ip_addrresses.size()];
-     
-  for (int i = 0; i < ip_addrresses.size(); ++i) {
-    threads[i] = ThreadPtr(new std::thread(run_server, ip_addrresses[i]));
-  }
-
-  for (int i = 0; i < sizeof(threads); ++i) {
-    threads[i]->join();
+void raise_file_limit() {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
   }
 }
-
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <grpc++/grpc++.h>
+
+#include "store.grpc.pb.h"
+#include "product_queries_util.h"
+#include "reply_dictionary.h"
+
+// An asynchronous client for the store, meant to be kept for the life of the
+// service that embeds it. Queries are spread round-robin over a pool of
+// channels, each its own connection, and are pipelined: sending one never
+// waits for an earlier one to come back. Completions are handled by a few
+// threads of the client's own, so a single caller thread can keep thousands
+// of queries in flight. Every query has a deadline.
+class StoreClient {
+ public:
+  struct Options {
+    // Connections to the store
+    int channels = 4;
+    // Threads running the callbacks
+    int completion_threads = 1;
+    // Used for queries that do not give their own
+    std::chrono::milliseconds deadline = std::chrono::milliseconds(5000);
+    // Ask for compact replies; the bids are still handed over in full
+    bool compact = false;
+  };
+
+  struct Outcome {
+    grpc::Status status;
+    ProductQueryResult result;
+  };
+
+  // Runs on a completion thread, so it should not block
+  typedef std::function<void(Outcome&)> Callback;
+
+  StoreClient(const std::string& server_addr, const Options& options);
+  // Waits for the queries still in flight, which their deadlines bound
+  ~StoreClient();
+
+  // Sends "query" and calls "done" once it is answered or fails. A zero
+  // deadline means the client's default.
+  void get_products(const store::ProductQuery& query, Callback done,
+                    std::chrono::milliseconds deadline = std::chrono::milliseconds::zero());
+  std::future<Outcome> get_products(const store::ProductQuery& query,
+                                    std::chrono::milliseconds deadline = std::chrono::milliseconds::zero());
+  // Blocks until the query is answered; false if it failed
+  bool getProducts(const ProductSpec& product_spec, ProductQueryResult& query_result);
+
+  // Queries sent and not yet called back
+  long in_flight() const;
+
+ private:
+  struct PendingQuery;
+
+  void handle_completions();
+
+  std::vector<std::unique_ptr<store::Store::Stub> > stubs_;
+  std::atomic<unsigned> next_;
+  grpc::CompletionQueue cq_;
+  std::vector<std::thread> threads_;
+  Options options_;
+  ReplyDictionary dictionary_;
+  std::atomic<long> in_flight_;
+  std::mutex drained_mutex_;
+  std::condition_variable drained_;
+};
+
+// Queries the store at "server_addr" for one product and waits for the
+// answer, over a client kept per address rather than a new channel per call.
+bool run_client(const std::string& server_addr, const std::string& product_name, ProductQueryResult& pq_result);
@@ -0,0 +1,199 @@
+// Measures task throughput of the store's threadpool against the original
+// single-queue design across worker counts.
+//
+//   ./threadpool_bench [tasks_per_run]
+
+#include "threadpool.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <new>
+#include <vector>
+
+// Every heap allocation in the process, to show what a submission costs.
+static std::atomic<long> allocations(0);
+
+void* operator new(std::size_t size) {
+  ++allocations;
+  if (void* p = std::malloc(size ? size : 1)) return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+// The threadpool as it was before work stealing: one queue, one lock and one
+// condition variable shared by the dispatcher and every worker.
+class single_queue_pool {
+ public:
+  single_queue_pool(int num_threads) : stop_(false) {
+    for (int i = 0; i < num_threads; ++i) {
+      workers_.emplace_back([this] {
+        while (true) {
+          std::function<void()> task;
+          {
+            std::unique_lock<std::mutex> lock(queue_mutex_);
+            condition_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+            if (stop_ && tasks_.empty()) return;
+            task = tasks_.front();
+            tasks_.pop();
+          }
+          task();
+        }
+      });
+    }
+  }
+
+  template<class F>
+  std::future<void> enqueue(F&& f) {
+    auto task = std::make_shared<std::packaged_task<void()> >(std::forward<F>(f));
+    std::future<void> res = task->get_future();
+    {
+      std::unique_lock<std::mutex> lock(queue_mutex_);
+      tasks_.emplace([task]() { (*task)(); });
+    }
+    condition_.notify_one();
+    return res;
+  }
+
+  ~single_queue_pool() {
+    {
+      std::unique_lock<std::mutex> lock(queue_mutex_);
+      stop_ = true;
+    }
+    condition_.notify_all();
+    for (std::thread& worker : workers_) worker.join();
+  }
+
+ private:
+  std::vector<std::thread> workers_;
+  std::queue<std::function<void()> > tasks_;
+  std::mutex queue_mutex_;
+  std::condition_variable condition_;
+  bool stop_;
+};
+
+// A few hundred nanoseconds of work, roughly one CallData::Proceed step.
+static void small_work() {
+  volatile unsigned x = 0;
+  for (int i = 0; i < 64; ++i) x += i;
+}
+
+static void wait_for(std::atomic<long>& done, long target) {
+  while (done.load() < target) std::this_thread::yield();
+}
+
+struct use_enqueue {
+  template<class Pool, class F>
+  static void submit(Pool& pool, F&& f) { pool.enqueue(std::forward<F>(f)); }
+};
+
+struct use_post {
+  template<class Pool, class F>
+  static void submit(Pool& pool, F&& f) { pool.post(std::forward<F>(f)); }
+};
+
+// One dispatcher thread feeding every task in, like HandleRpcs does.
+template<class Pool, class Submit = use_enqueue>
+double run_external(int threads, long tasks) {
+  std::atomic<long> done(0);
+  Pool pool(threads);
+  auto start = std::chrono::steady_clock::now();
+  for (long i = 0; i < tasks; ++i) {
+    Submit::submit(pool, [&done] { small_work(); ++done; });
+  }
+  wait_for(done, tasks);
+  std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+  return tasks / secs.count();
+}
+
+// Allocations per task once the pool has warmed up, with at most
+// "in_flight" tasks outstanding the way a completion queue's events are.
+template<class Pool, class Submit>
+double allocations_per_task(int threads, long tasks, long in_flight) {
+  std::atomic<long> done(0);
+  Pool pool(threads);
+  long allocs_before = 0;
+  for (long i = 0; i < 2 * tasks; ++i) {
+    if (i == tasks) {
+      wait_for(done, tasks);
+      allocs_before = allocations.load();
+    }
+    while (i - done.load() >= in_flight) std::this_thread::yield();
+    Submit::submit(pool, [&done] { small_work(); ++done; });
+  }
+  wait_for(done, 2 * tasks);
+  return double(allocations.load() - allocs_before) / tasks;
+}
+
+// Tasks that submit follow-up work from inside the pool, like a vendor
+// completion being handed back to a worker.
+template<class Pool>
+struct spawner {
+  Pool* pool;
+  std::atomic<long>* done;
+  int depth;
+  void operator()() const {
+    small_work();
+    if (depth > 0) {
+      spawner child = { pool, done, depth - 1 };
+      pool->enqueue(child);
+      pool->enqueue(child);
+    }
+    ++*done;
+  }
+};
+
+template<class Pool>
+double run_nested(int threads, long tasks) {
+  const int depth = 10;  // 2^11 - 1 tasks per tree
+  long per_tree = (2L << depth) - 1;
+  long trees = std::max(1L, tasks / per_tree);
+  std::atomic<long> done(0);
+  Pool pool(threads);
+  auto start = std::chrono::steady_clock::now();
+  for (long i = 0; i < trees; ++i) {
+    spawner<Pool> root = { &pool, &done, depth };
+    pool.enqueue(root);
+  }
+  wait_for(done, trees * per_tree);
+  std::chrono::duration<double> secs = std::chrono::steady_clock::now() - start;
+  return trees * per_tree / secs.count();
+}
+
+int main(int argc, char** argv) {
+  long tasks = argc > 1 ? atol(argv[1]) : 200000;
+  const int thread_counts[] = { 1, 2, 4, 8, 16, 20, 32, 64 };
+
+  std::printf("hardware threads: %u, tasks per run: %ld\n", std::thread::hardware_concurrency(), tasks);
+  std::printf("%8s %22s %22s %22s %22s %22s\n", "threads", "single_queue external",
+              "work_stealing external", "work_stealing post", "single_queue nested",
+              "work_stealing nested");
+  for (int threads : thread_counts) {
+    std::printf("%8d %20.0f/s %20.0f/s %20.0f/s %20.0f/s %20.0f/s\n", threads,
+                run_external<single_queue_pool>(threads, tasks),
+                run_external<threadpool>(threads, tasks),
+                run_external<threadpool, use_post>(threads, tasks),
+                run_nested<single_queue_pool>(threads, tasks),
+                run_nested<threadpool>(threads, tasks));
+    std::fflush(stdout);
+  }
+
+  const long in_flight = 1024;
+  std::printf("\nallocations per task, 4 threads, %ld in flight: single_queue enqueue %.2f, "
+              "work_stealing enqueue %.2f, work_stealing post %.2f\n", in_flight,
+              allocations_per_task<single_queue_pool, use_enqueue>(4, tasks, in_flight),
+              allocations_per_task<threadpool, use_enqueue>(4, tasks, in_flight),
+              allocations_per_task<threadpool, use_post>(4, tasks, in_flight));
+  return 0;
+}
@@ -0,0 +1,131 @@
+// Compares the transports the store can reach a vendor over: loopback TCP, a
+// unix domain socket, and an in-process channel into the vendor's own server.
+// One vendor is served on all three at once. For each transport it measures
+// the round trip of one bid at a time, then throughput with many bids in
+// flight on one channel.
+//
+//   ./transport_bench [calls_per_run] [in_flight]
+
+#include "histogram.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <grpc++/grpc++.h>
+
+#include "vendor.grpc.pb.h"
+
+typedef std::chrono::steady_clock clock_type;
+
+// Answers every bid at once, so all that is measured is the transport
+class InstantVendor final : public vendor::Vendor::Service {
+  grpc::Status getProductBid(grpc::ServerContext*, const vendor::BidQuery*,
+                             vendor::BidReply* reply) override {
+    reply->set_price(42);
+    reply->set_vendor_id("Vendor_bench");
+    return grpc::Status::OK;
+  }
+};
+
+// Round trips of one bid at a time, in nanoseconds
+LatencyHistogram measure_latency(vendor::Vendor::Stub* stub, long calls) {
+  LatencyHistogram latency;
+  vendor::BidQuery query;
+  query.set_product_name("bike1");
+  for (long i = 0; i < calls; ++i) {
+    vendor::BidReply reply;
+    grpc::ClientContext context;
+    clock_type::time_point start = clock_type::now();
+    grpc::Status status = stub->getProductBid(&context, query, &reply);
+    if (!status.ok()) {
+      std::fprintf(stderr, "bid failed: %s\n", status.error_message().c_str());
+      std::exit(EXIT_FAILURE);
+    }
+    latency.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - start).count());
+  }
+  return latency;
+}
+
+struct AsyncBid {
+  vendor::BidReply reply;
+  grpc::ClientContext context;
+  grpc::Status status;
+  std::unique_ptr<grpc::ClientAsyncResponseReader<vendor::BidReply> > reader;
+};
+
+// Bids per second with "in_flight" outstanding at all times
+double measure_throughput(vendor::Vendor::Stub* stub, long calls, int in_flight) {
+  grpc::CompletionQueue cq;
+  vendor::BidQuery query;
+  query.set_product_name("bike1");
+  long sent = 0;
+  auto send = [&]() {
+    AsyncBid* bid = new AsyncBid();
+    bid->reader = stub->PrepareAsyncgetProductBid(&bid->context, query, &cq);
+    bid->reader->StartCall();
+    bid->reader->Finish(&bid->reply, &bid->status, bid);
+    ++sent;
+  };
+  clock_type::time_point start = clock_type::now();
+  for (int i = 0; i < in_flight && sent < calls; ++i) {
+    send();
+  }
+  void* tag;
+  bool ok;
+  for (long done = 0; done < calls && cq.Next(&tag, &ok); ++done) {
+    delete static_cast<AsyncBid*>(tag);
+    if (sent < calls) {
+      send();
+    }
+  }
+  double seconds = std::chrono::duration<double>(clock_type::now() - start).count();
+  cq.Shutdown();
+  while (cq.Next(&tag, &ok)) {
+  }
+  return calls / seconds;
+}
+
+int main(int argc, char** argv) {
+  long calls = argc > 1 ? atol(argv[1]) : 20000;
+  int in_flight = argc > 2 ? atoi(argv[2]) : 64;
+  const std::string tcp = "localhost:50499";
+  const std::string unix_socket = "unix:/tmp/transport_bench.sock";
+
+  InstantVendor service;
+  grpc::ServerBuilder builder;
+  builder.AddListeningPort(tcp, grpc::InsecureServerCredentials());
+  builder.AddListeningPort(unix_socket, grpc::InsecureServerCredentials());
+  builder.RegisterService(&service);
+  std::unique_ptr<grpc::Server> server(builder.BuildAndStart());
+  if (!server) {
+    std::fprintf(stderr, "Failed to start the vendor\n");
+    return EXIT_FAILURE;
+  }
+
+  struct Transport {
+    const char* name;
+    std::shared_ptr<grpc::Channel> channel;
+  };
+  std::vector<Transport> transports;
+  transports.push_back(Transport{"tcp", grpc::CreateChannel(tcp, grpc::InsecureChannelCredentials())});
+  transports.push_back(Transport{"unix", grpc::CreateChannel(unix_socket, grpc::InsecureChannelCredentials())});
+  transports.push_back(Transport{"inprocess", server->InProcessChannel(grpc::ChannelArguments())});
+
+  std::printf("calls per run: %ld, in flight for throughput: %d\n", calls, in_flight);
+  std::printf("%10s %12s %12s %12s %16s\n", "transport", "p50_us", "p99_us", "mean_us", "throughput");
+  for (size_t i = 0; i < transports.size(); ++i) {
+    std::unique_ptr<vendor::Vendor::Stub> stub(vendor::Vendor::NewStub(transports[i].channel));
+    // Warm up the connection and the allocator
+    measure_latency(stub.get(), calls / 10 + 1);
+    LatencyHistogram latency = measure_latency(stub.get(), calls);
+    double throughput = measure_throughput(stub.get(), calls, in_flight);
+    std::printf("%10s %12.1f %12.1f %12.1f %14.0f/s\n", transports[i].name, latency.Percentile(50) / 1000.0,
+                latency.Percentile(99) / 1000.0, latency.Mean() / 1000.0, throughput);
+  }
+  server->Shutdown();
+  return EXIT_SUCCESS;
+}
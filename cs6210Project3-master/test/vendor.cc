@@ -1,46 +1,97 @@
 #include <memory>
 #include <iostream>
-#include <functional>
+#include <thread>
+#include <vector>
 
 #include <grpc++/grpc++.h>
 
-#include "vendor.grpc.pb.h"
+#include "hosted_vendor.h"
+#include "vendor_profile.h"
 
 using grpc::Server;
 using grpc::ServerBuilder;
-using grpc::ServerContext;
-using grpc::Status;
+using grpc::ServerCompletionQueue;
 using vendor::BidQuery;
 using vendor::BidReply;
+using vendor::BidBatchQuery;
+using vendor::BidBatchReply;
 using vendor::Vendor;
 
-class VendorService final : public Vendor::Service {
+// Hosts any number of vendors in one process, on one async server. Every
+// vendor address is a listening port, and each vendor's service is registered
+// for its own address as the host, so a call is routed by the authority the
+// store dialled. That is the address itself, as long as the store dials the
+// addresses exactly as listed. A few completion queue threads serve every
+// vendor, and emulated latency is an alarm rather than a sleeping thread, so
+// a thousand vendors cost a thousand listening sockets, not a thousand threads.
+// Pricing and call handling are src/hosted_vendor.h, shared with the vendors
+// the store hosts itself.
 
-  public:
-    VendorService(const std::string& server_address) : id_("Vendor_" + server_address) {}
+namespace {
 
-  private:
-    Status getProductBid(ServerContext* context, const BidQuery* request,
-                    BidReply* reply) override {
-      reply->set_price(hasher_(id_ + request->product_name()) % 100);
-      reply->set_vendor_id(id_);
-      return Status::OK;
+// A vendor that takes as long and fails as often as its profile says
+class ProfiledVendor : public HostedVendor {
+ public:
+  ProfiledVendor(const std::string& address, const VendorProfile& profile)
+    : HostedVendor(address), profile_(profile), queue_(profile.max_qps) {}
+
+  bool Emulated() const override { return profile_.emulated(); }
+
+  clock::duration Delay(int bids) override {
+    clock::time_point start = clock::now();
+    for (int i = 0; i < bids; ++i) {
+      start = queue_.admit();
     }
+    return start + profile_.sample_latency() - clock::now();
+  }
 
-    std::hash<std::string> hasher_;
-    const std::string id_;
+  bool InjectError() override { return profile_.sample_error(); }
+
+ private:
+  const VendorProfile profile_;
+  ServiceQueue queue_;
 };
 
-void run_server(const std::string server_address)   {
-  std::string server_addressess(server_address);
-  VendorService service(server_address);
+void serve_queue(ServerCompletionQueue* cq) {
+  void* tag;
+  bool ok;
+  while (cq->Next(&tag, &ok)) {
+    static_cast<CompletionTag*>(tag)->Proceed(ok);
+  }
+}
+
+}  // namespace
 
+void run_vendor_host(const std::vector<std::string>& addresses, const VendorProfiles& profiles, int num_cqs) {
+  std::vector<std::unique_ptr<ProfiledVendor> > vendors;
   ServerBuilder builder;
-  builder.AddListeningPort(server_addressess, grpc::InsecureServerCredentials());
-  builder.RegisterService(&service);
+  for (size_t i = 0; i < addresses.size(); ++i) {
+    vendors.emplace_back(new ProfiledVendor(addresses[i], profiles.get(addresses[i])));
+    builder.AddListeningPort(addresses[i], grpc::InsecureServerCredentials());
+    builder.RegisterService(addresses[i], &vendors.back()->service());
+  }
+  std::vector<std::unique_ptr<ServerCompletionQueue> > cqs;
+  for (int i = 0; i < num_cqs; ++i) {
+    cqs.push_back(builder.AddCompletionQueue());
+  }
 
   std::unique_ptr<Server> server(builder.BuildAndStart());
-  std::cout << "Server listening on " << server_addressess << std::endl;
+  if (!server) {
+    std::cerr << "Failed to start the vendors" << std::endl;
+    return;
+  }
+  for (size_t i = 0; i < vendors.size(); ++i) {
+    ServerCompletionQueue* cq = cqs[i % cqs.size()].get();
+    new VendorCall<BidQuery, BidReply>(vendors[i].get(), &Vendor::AsyncService::RequestgetProductBid, cq);
+    new VendorCall<BidBatchQuery, BidBatchReply>(vendors[i].get(), &Vendor::AsyncService::RequestgetProductBids, cq);
+  }
+  std::cout << "Serving " << vendors.size() << " vendors on " << cqs.size() << " completion queues" << std::endl;
 
-  server->Wait();
-}
\ No newline at end of file
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < cqs.size(); ++i) {
+    threads.emplace_back(serve_queue, cqs[i].get());
+  }
+  for (size_t i = 0; i < threads.size(); ++i) {
+    threads[i].join();
+  }
+}
@@ -0,0 +1,202 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// How an emulated vendor behaves: how long it takes to answer, how often it
+// fails, and how many bids a second it can serve. Profiles come from a file
+// with one vendor per line, "*" standing for every vendor not listed:
+//
+//   # address        settings
+//   *                latency=fixed:1
+//   localhost:50051  latency=lognormal:5:0.5 errors=0.01
+//   localhost:50052  latency=bimodal:2:80:0.05 max_qps=2000
+//
+// latency is in milliseconds and is one of
+//   fixed:MS                    always MS
+//   lognormal:MEDIAN_MS:SIGMA   lognormal around MEDIAN_MS; SIGMA sets the tail
+//   bimodal:FAST_MS:SLOW_MS:P   SLOW_MS for a fraction P of bids, else FAST_MS
+// errors is the fraction of bids that fail with UNAVAILABLE. max_qps makes
+// the vendor serve one bid at a time at that rate, so bids queue once it
+// is saturated.
+struct VendorProfile {
+  enum Distribution { FIXED, LOGNORMAL, BIMODAL };
+
+  typedef std::chrono::steady_clock clock;
+
+  Distribution distribution = FIXED;
+  // FIXED and BIMODAL use fast_ms, LOGNORMAL uses it as the median
+  double fast_ms = 0;
+  double slow_ms = 0;
+  double slow_fraction = 0;
+  double sigma = 0;
+  double error_rate = 0;
+  double max_qps = 0;
+
+  // Whether the vendor behaves any differently from an instant reply
+  bool emulated() const {
+    return fast_ms > 0 || slow_fraction > 0 || error_rate > 0 || max_qps > 0;
+  }
+
+  // How long to take over one bid, not counting any queueing
+  clock::duration sample_latency() const {
+    double ms = fast_ms;
+    if (distribution == LOGNORMAL && fast_ms > 0) {
+      std::lognormal_distribution<double> lognormal(std::log(fast_ms), sigma);
+      ms = lognormal(rng());
+    } else if (distribution == BIMODAL && uniform() < slow_fraction) {
+      ms = slow_ms;
+    }
+    return std::chrono::duration_cast<clock::duration>(std::chrono::duration<double, std::milli>(ms));
+  }
+
+  bool sample_error() const {
+    return error_rate > 0 && uniform() < error_rate;
+  }
+
+  // Parses "latency=... errors=... max_qps=..." settings
+  bool parse(const std::string& settings) {
+    std::stringstream in(settings);
+    std::string setting;
+    while (in >> setting) {
+      size_t eq = setting.find('=');
+      if (eq == std::string::npos) {
+        return false;
+      }
+      std::string name = setting.substr(0, eq);
+      std::string value = setting.substr(eq + 1);
+      if (name == "latency") {
+        if (!parse_latency(value)) {
+          return false;
+        }
+      } else if (name == "errors") {
+        error_rate = std::min(1.0, std::max(0.0, atof(value.c_str())));
+      } else if (name == "max_qps") {
+        max_qps = std::max(0.0, atof(value.c_str()));
+      } else {
+        return false;
+      }
+    }
+    return true;
+  }
+
+ private:
+  static std::mt19937_64& rng() {
+    static thread_local std::mt19937_64 engine(
+        std::random_device{}() ^ std::hash<std::thread::id>()(std::this_thread::get_id()));
+    return engine;
+  }
+
+  static double uniform() {
+    return std::uniform_real_distribution<double>(0, 1)(rng());
+  }
+
+  bool parse_latency(const std::string& value) {
+    std::vector<std::string> parts;
+    std::stringstream in(value);
+    std::string part;
+    while (std::getline(in, part, ':')) {
+      parts.push_back(part);
+    }
+    if (parts.size() == 2 && parts[0] == "fixed") {
+      distribution = FIXED;
+      fast_ms = atof(parts[1].c_str());
+    } else if (parts.size() == 3 && parts[0] == "lognormal") {
+      distribution = LOGNORMAL;
+      fast_ms = atof(parts[1].c_str());
+      sigma = atof(parts[2].c_str());
+    } else if (parts.size() == 4 && parts[0] == "bimodal") {
+      distribution = BIMODAL;
+      fast_ms = atof(parts[1].c_str());
+      slow_ms = atof(parts[2].c_str());
+      slow_fraction = std::min(1.0, std::max(0.0, atof(parts[3].c_str())));
+    } else {
+      return false;
+    }
+    return fast_ms >= 0 && slow_ms >= 0 && sigma >= 0;
+  }
+};
+
+// Serves bids one at a time at a vendor's max_qps. Each bid is given the next
+// free service slot, so once bids come in faster than that they queue and
+// their wait grows, as with a saturated server.
+class ServiceQueue {
+ public:
+  explicit ServiceQueue(double max_qps)
+    : per_bid_(max_qps > 0 ? std::chrono::duration_cast<VendorProfile::clock::duration>(
+                                 std::chrono::duration<double>(1.0 / max_qps))
+                           : VendorProfile::clock::duration::zero()) {}
+
+  // When a bid arriving now may start being served
+  VendorProfile::clock::time_point admit() {
+    VendorProfile::clock::time_point now = VendorProfile::clock::now();
+    if (per_bid_ == VendorProfile::clock::duration::zero()) {
+      return now;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    VendorProfile::clock::time_point start = std::max(now, next_free_);
+    next_free_ = start + per_bid_;
+    return start;
+  }
+
+ private:
+  const VendorProfile::clock::duration per_bid_;
+  std::mutex mutex_;
+  VendorProfile::clock::time_point next_free_;
+};
+
+// Every vendor's profile, read from a profile file
+class VendorProfiles {
+ public:
+  bool load(const std::string& filename) {
+    std::ifstream file(filename);
+    if (!file.is_open()) {
+      std::cerr << "Failed to open file " << filename << std::endl;
+      return false;
+    }
+    std::string line;
+    int number = 0;
+    while (std::getline(file, line)) {
+      ++number;
+      line = line.substr(0, line.find('#'));
+      std::stringstream in(line);
+      std::string address;
+      if (!(in >> address)) {
+        continue;
+      }
+      std::string settings;
+      std::getline(in, settings);
+      VendorProfile profile;
+      if (!profile.parse(settings)) {
+        std::cerr << filename << ":" << number << ": invalid vendor profile" << std::endl;
+        return false;
+      }
+      if (address == "*") {
+        default_ = profile;
+      } else {
+        profiles_[address] = profile;
+      }
+    }
+    return true;
+  }
+
+  const VendorProfile& get(const std::string& address) const {
+    std::map<std::string, VendorProfile>::const_iterator found = profiles_.find(address);
+    return found == profiles_.end() ? default_ : found->second;
+  }
+
+ private:
+  VendorProfile default_;
+  std::map<std::string, VendorProfile> profiles_;
+};